@@ -0,0 +1,99 @@
+# Renders web/index.html once per language in web/lang/ and embeds the
+# gzipped results in src/web_pages.h. Runs as a PlatformIO pre-build script,
+# or standalone: python scripts/build_web.py
+import gzip
+import html
+import json
+import os
+import re
+import sys
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(sys.argv[0])))
+
+# Order matters: the index of a language is its id in firmware.
+LANGS = ["fr", "en"]
+DEFAULT_LANG = "en"
+
+TEMPLATE = os.path.join(PROJECT_DIR, "web", "index.html")
+LANG_DIR = os.path.join(PROJECT_DIR, "web", "lang")
+OUTPUT = os.path.join(PROJECT_DIR, "src", "web_pages.h")
+
+PLACEHOLDER = re.compile(r"\{\{(js:)?([a-z0-9_]+)\}\}")
+
+
+def js_escape(text):
+    return text.replace("\\", "\\\\").replace("'", "\\'").replace("\n", "\\n")
+
+
+def render(template, lang, strings):
+    strings = dict(strings, lang=lang)
+
+    def sub(match):
+        key = match.group(2)
+        if key not in strings:
+            sys.exit("build_web: missing key '%s' in web/lang/%s.json" % (key, lang))
+        if match.group(1):
+            return js_escape(strings[key])
+        return html.escape(strings[key], quote=False).replace('"', "&quot;")
+
+    return PLACEHOLDER.sub(sub, template)
+
+
+def c_array(name, data):
+    lines = ["static const uint8_t %s[] PROGMEM = {" % name]
+    for i in range(0, len(data), 16):
+        lines.append("    " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    with open(TEMPLATE, encoding="utf-8") as f:
+        template = f.read()
+
+    arrays = []
+    entries = []
+    for lang in LANGS:
+        with open(os.path.join(LANG_DIR, lang + ".json"), encoding="utf-8") as f:
+            strings = json.load(f)
+        page = render(template, lang, strings).encode("utf-8")
+        packed = gzip.compress(page, compresslevel=9, mtime=0)
+        arrays.append(c_array("web_page_" + lang, packed))
+        entries.append('    {"%s", web_page_%s, sizeof(web_page_%s)},' % (lang, lang, lang))
+        print("build_web: %s %d -> %d bytes" % (lang, len(page), len(packed)))
+
+    out = "\n".join([
+        "// Generated by scripts/build_web.py from web/ - do not edit",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+        "struct WebPage {",
+        "    const char *lang;",
+        "    const uint8_t *data;",
+        "    size_t len;",
+        "};",
+        "",
+        "\n\n".join(arrays),
+        "",
+        "static const WebPage web_pages[] = {",
+        "\n".join(entries),
+        "};",
+        "",
+        "#define WEB_PAGE_COUNT %d" % len(LANGS),
+        "#define WEB_PAGE_DEFAULT %d" % LANGS.index(DEFAULT_LANG),
+        "",
+    ])
+
+    if os.path.exists(OUTPUT):
+        with open(OUTPUT, encoding="utf-8") as f:
+            if f.read() == out:
+                return
+    with open(OUTPUT, "w", encoding="utf-8") as f:
+        f.write(out)
+
+
+main()
@@ -0,0 +1,141 @@
+// Relay current sensing: batch statistics and fault detection.
+// Plain integer C++ with no Arduino or IDF dependencies, so recorded sample
+// buffers can be fed through it on a host exactly as the ADC task does.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define CURRENT_CHANNELS 4
+
+#define CURRENT_FAULT_OVERCURRENT 0x01  // above overcurrent_ma after the inrush settled
+#define CURRENT_FAULT_NO_LOAD 0x02      // relay on but (almost) no current: open coil, dry pump
+#define CURRENT_FAULT_INRUSH 0x04       // switch-on surge lasted longer than inrush_max_ms
+#define CURRENT_FAULT_STUCK_ON 0x08     // current flowing while the relay is off
+
+struct CurrentChannelConfig {
+    uint16_t zero_offset;       // ADC counts at 0 A
+    int32_t ma_per_count_q8;    // mA per ADC count, Q8 (256 = 1 mA/count)
+    uint32_t overcurrent_ma;
+    uint32_t no_load_ma;
+    uint32_t inrush_max_ms;
+    uint32_t off_settle_ms;     // wait after switch-off before checking stuck-on;
+                                // at least one window, which still holds on-time samples
+};
+
+struct CurrentSample {
+    uint8_t channel;            // index 0..CURRENT_CHANNELS-1
+    uint16_t value;             // raw 12-bit ADC count
+};
+
+struct CurrentAccumulator {
+    int64_t sum;
+    uint64_t sum_sq;
+    uint32_t count;
+};
+
+struct CurrentReading {
+    int32_t avg_ma;             // signed mean, i.e. the DC component
+    uint32_t rms_ma;
+    uint32_t samples;
+};
+
+struct CurrentChannelState {
+    uint8_t faults;
+    bool relay_on;
+    bool inrush_done;
+    uint32_t on_since_ms;
+    uint32_t off_since_ms;
+};
+
+inline uint32_t current_isqrt(uint64_t v) {
+    uint64_t res = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > v) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (v >= res + bit) {
+            v -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)res;
+}
+
+inline void current_accumulate(CurrentAccumulator acc[CURRENT_CHANNELS], const CurrentSample *samples, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (samples[i].channel >= CURRENT_CHANNELS) {
+            continue;
+        }
+        CurrentAccumulator &a = acc[samples[i].channel];
+        uint32_t v = samples[i].value;
+        a.sum += v;
+        a.sum_sq += v * v;
+        a.count++;
+    }
+}
+
+// Turns one window of raw counts into mA, centred on the zero-current offset
+inline void current_finish(const CurrentAccumulator &acc, const CurrentChannelConfig &cfg, CurrentReading &out) {
+    out.samples = acc.count;
+    if (acc.count == 0) {
+        out.avg_ma = 0;
+        out.rms_ma = 0;
+        return;
+    }
+
+    int64_t n = acc.count;
+    int64_t off = cfg.zero_offset;
+    int64_t scale = cfg.ma_per_count_q8 < 0 ? -(int64_t)cfg.ma_per_count_q8 : cfg.ma_per_count_q8;
+    // sum((x - off)^2) = sum(x^2) - 2*off*sum(x) + off^2*n
+    int64_t centred_sum = acc.sum - off * n;
+    int64_t centred_sq = (int64_t)acc.sum_sq - 2 * off * acc.sum + off * off * n;
+    if (centred_sq < 0) {
+        centred_sq = 0;
+    }
+
+    out.avg_ma = (int32_t)(centred_sum * cfg.ma_per_count_q8 / (n * 256));
+    // Square root taken in Q4 counts to keep a fractional count of resolution
+    uint64_t rms_q4 = current_isqrt((uint64_t)centred_sq * 256 / n);
+    out.rms_ma = (uint32_t)((rms_q4 * scale) >> 12);
+}
+
+// Updates the channel's fault flags from a fresh reading and returns the
+// flags that were not already raised.
+inline uint8_t current_evaluate(CurrentChannelState &st, const CurrentChannelConfig &cfg,
+                                const CurrentReading &r, bool relay_on, uint32_t now_ms) {
+    if (relay_on && !st.relay_on) {
+        st.on_since_ms = now_ms;
+        st.inrush_done = false;
+    } else if (!relay_on && st.relay_on) {
+        st.off_since_ms = now_ms;
+    }
+    st.relay_on = relay_on;
+
+    uint8_t faults = 0;
+    if (relay_on) {
+        uint32_t on_for = now_ms - st.on_since_ms;
+        bool over = r.rms_ma > cfg.overcurrent_ma;
+        if (!st.inrush_done) {
+            if (!over) {
+                st.inrush_done = true;
+            } else if (on_for > cfg.inrush_max_ms) {
+                faults |= CURRENT_FAULT_INRUSH;
+            }
+        } else if (over) {
+            faults |= CURRENT_FAULT_OVERCURRENT;
+        }
+        if (on_for > cfg.inrush_max_ms && r.rms_ma < cfg.no_load_ma) {
+            faults |= CURRENT_FAULT_NO_LOAD;
+        }
+    } else if (now_ms - st.off_since_ms >= cfg.off_settle_ms && r.rms_ma > cfg.no_load_ma) {
+        faults |= CURRENT_FAULT_STUCK_ON;
+    }
+
+    uint8_t raised = faults & ~st.faults;
+    st.faults = faults;
+    return raised;
+}
@@ -4,7 +4,15 @@
 #include <SPIFFS.h>
 #include <preferences.h>
 #include <Update.h>
+#include <HTTPClient.h>
+#include <WiFiUdp.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <math.h>
 #include "cJSON.h"
+#include "web_pages.h"
+#include "current_sense.h"
 
 #define RELAY_IN1 33
 #define RELAY_IN2 25
@@ -13,713 +21,1986 @@
 
 #define WIFI_SSID "AirBox"
 #define WIFI_PASSWORD "12345678"
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+
+// Fast boot brings up GPIO and the HTTP listener before WiFi has connected
+// and defers SPIFFS; build with -DAIRBOX_FAST_BOOT=0 for the old blocking sequence
+#ifndef AIRBOX_FAST_BOOT
+#define AIRBOX_FAST_BOOT 1
+#endif
+
+#define BOOT_MARKS_MAX 12
+
+// Current sensing needs one analog sensor per relay on ADC1 (GPIO 36, 39, 34,
+// 35); build with -DAIRBOX_CURRENT_SENSE=1 once they are wired
+#ifndef AIRBOX_CURRENT_SENSE
+#define AIRBOX_CURRENT_SENSE 0
+#endif
+
+#define CURRENT_SAMPLE_RATE_HZ 20000
+#define CURRENT_WINDOW_SAMPLES 500
+#define CURRENT_DMA_READ_BYTES 256
+#define CURRENT_ZERO_OFFSET 2048
+#define CURRENT_MA_PER_COUNT_Q8 2063
+#define CURRENT_OVERCURRENT_MA 8000
+#define CURRENT_NO_LOAD_MA 150
+#define CURRENT_INRUSH_MAX_MS 500
+#define CURRENT_OFF_SETTLE_MS 200
+
+#if AIRBOX_CURRENT_SENSE
+#include <driver/adc.h>
+#endif
+
+// Version of this firmware, compared by the fleet so boxes only ever move to
+// a newer one; set it per release, e.g. build_flags = -DAIRBOX_FW_VERSION=\"1.4.0\"
+#ifndef AIRBOX_FW_VERSION
+#define AIRBOX_FW_VERSION "1.0.0"
+#endif
+
+// Boxes only pull firmware announced by peers when built with
+// -DAIRBOX_FLEET_PULL=1; see "Fleet OTA" in the README before enabling
+#ifndef AIRBOX_FLEET_PULL
+#define AIRBOX_FLEET_PULL 0
+#endif
+
+#define FLEET_PORT 4211
+#define FLEET_ANNOUNCE_MS 2000
+#define FLEET_CHUNK 4096
+#define FLEET_CHUNK_MAX 16384
+#define FLEET_SOURCES_MAX 8
+#define FLEET_RETRIES_MAX 20
+#define FLEET_HTTP_TIMEOUT_MS 5000
+#define FLEET_RETRY_MS 30000
+#define FLEET_SERVE_IDLE_MS 15000
+#define FLEET_RESTART_MIN_MS 20000
+#define FLEET_RESTART_STAGGER_MS 5000
+#define FLEET_RESTART_SLOTS 16
+
+// Long-poll clients. Each parked one holds an lwIP socket, out of
+// CONFIG_LWIP_MAX_SOCKETS (16 in the Arduino core). STATE_SOCKETS_RESERVED
+// covers the HTTP and Modbus listeners, the fleet UDP socket, the request being
+// served and one outgoing fleet connection; connected Modbus masters are
+// subtracted at run time. That leaves room for all 10 with no master connected.
+#define STATE_WAITERS_MAX 10
+#define STATE_SOCKETS_RESERVED 5
+#define STATE_WAIT_RETRY_S 5
+#define STATE_WAIT_DEFAULT_MS 25000
+#define STATE_WAIT_MAX_MS 60000
+
+#define MODBUS_PORT 502
+#define MODBUS_CLIENTS_MAX 4
+#define MODBUS_IDLE_TIMEOUT_MS 60000
+#define MODBUS_FRAME_MAX 260
+
+#define CBOR_REPLY_MAX 512
+#define CBOR_MAX_DEPTH 4
+#define REQUEST_BODY_MAX 512
+
+#define RELAY_MIN_DWELL_MS 250
+
+// Per-IP token buckets: a strict one for /relay/* and /wifi/* and a looser one
+// for reads. 304s and parked long-polls are not charged.
+#define RATE_LIMIT_CLIENTS 8
+#ifndef AIRBOX_RATE_LIMIT_BURST
+#define AIRBOX_RATE_LIMIT_BURST 10
+#endif
+#ifndef AIRBOX_RATE_LIMIT_PER_SEC
+#define AIRBOX_RATE_LIMIT_PER_SEC 5
+#endif
+#ifndef AIRBOX_RATE_LIMIT_READ_BURST
+#define AIRBOX_RATE_LIMIT_READ_BURST 100
+#endif
+#ifndef AIRBOX_RATE_LIMIT_READ_PER_SEC
+#define AIRBOX_RATE_LIMIT_READ_PER_SEC 50
+#endif
+#define HTTP_REQUESTS_PER_LOOP 4
 
 WebServer server(80);
+WiFiServer modbus_server(MODBUS_PORT);
 Preferences preferences;
 
 uint8_t relay_states[4] = {0, 0, 0, 0};
 int relay_pins[4] = {RELAY_IN1, RELAY_IN2, RELAY_IN3, RELAY_IN4};
+// Level last written to each pin; relay_states may run ahead during the dwell window
+uint8_t relay_outputs[4] = {0, 0, 0, 0};
+unsigned long relay_changed_at[4] = {0, 0, 0, 0};
+// Relays from multi-relay commands still waiting to switch together
+uint8_t relay_batch_mask = 0;
+// Current-sensing fault flags per relay as last published to /state
+uint8_t relay_faults[4] = {0, 0, 0, 0};
+
+#if AIRBOX_CURRENT_SENSE
+// Current sensing, written by the ADC task and read by loop() under current_mux
+// ADC1 channels for GPIO 36, 39, 34, 35
+const uint8_t current_adc_channels[CURRENT_CHANNELS] = {0, 3, 6, 7};
+CurrentChannelConfig current_config[CURRENT_CHANNELS];
+CurrentChannelState current_states[CURRENT_CHANNELS];
+CurrentReading current_readings[CURRENT_CHANNELS];
+uint8_t current_raised[CURRENT_CHANNELS];
+portMUX_TYPE current_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
 String wifi_ssid_current = "";
 String wifi_ip_current = "";
 int8_t wifi_rssi = -100;
 uint8_t wifi_connected = 0;
-cJSON *translations[2] = {NULL, NULL};
-const char *lang_codes[2] = {"fr", "en"};
-
-const char* html_page = R"rawliteral(
-<!DOCTYPE html>
-<html lang="en">
-<head>
-    <meta charset="UTF-8">
-    <meta name="viewport" content="width=device-width,initial-scale=1.0">
-    <title>AirBox Control</title>
-    <style>
-        * { margin: 0; padding: 0; box-sizing: border-box; }
-        body { 
-            font-family: 'Segoe UI', Tahoma, Geneva, Verdana, sans-serif; 
-            background: linear-gradient(135deg, #0f0f0f 0%, #1a1a2e 100%); 
-            color: #e0e0e0; 
-            padding: 20px; 
-            min-height: 100vh;
-        }
-        .container { 
-            max-width: 900px; 
-            margin: 0 auto; 
-        }
-        header {
-            text-align: center;
-            margin-bottom: 40px;
-            padding: 20px 0;
-        }
-        h1 { 
-            color: #4db8ff; 
-            font-size: 2.5em;
-            margin-bottom: 10px;
-            text-shadow: 0 2px 10px rgba(77, 184, 255, 0.3);
-        }
-        .subtitle {
-            color: #90caf9;
-            font-size: 0.95em;
-            margin-top: 5px;
-        }
-        .grid {
-            display: grid;
-            grid-template-columns: 1fr 1fr;
-            gap: 20px;
-            margin-bottom: 20px;
-        }
-        @media (max-width: 768px) {
-            .grid { grid-template-columns: 1fr; }
-        }
-        .section { 
-            background: rgba(45, 45, 45, 0.8);
-            backdrop-filter: blur(10px);
-            border-radius: 12px; 
-            padding: 25px;
-            border: 1px solid rgba(77, 184, 255, 0.2);
-            box-shadow: 0 8px 32px rgba(0,0,0,0.3);
-            transition: all 0.3s ease;
-        }
-        .section:hover {
-            border-color: rgba(77, 184, 255, 0.4);
-            box-shadow: 0 12px 48px rgba(77, 184, 255, 0.1);
-        }
-        .section h2 { 
-            font-size: 1.3em; 
-            color: #4db8ff; 
-            margin-bottom: 15px;
-            display: flex;
-            align-items: center;
-            gap: 8px;
-        }
-        .icon {
-            width: 24px;
-            height: 24px;
-        }
-        .form-group { 
-            margin-bottom: 12px; 
-        }
-        label { 
-            display: block; 
-            margin-bottom: 6px; 
-            color: #ddd; 
-            font-weight: 600; 
-            font-size: 0.9em;
-        }
-        input, select { 
-            width: 100%; 
-            padding: 11px; 
-            border: 2px solid rgba(77, 184, 255, 0.3); 
-            border-radius: 8px; 
-            background: rgba(45, 45, 45, 0.6); 
-            color: #e0e0e0; 
-            font-size: 0.95em;
-            transition: all 0.2s;
-        }
-        input:focus, select:focus { 
-            outline: none; 
-            border-color: #4db8ff;
-            background: rgba(45, 45, 45, 0.9);
-            box-shadow: 0 0 10px rgba(77, 184, 255, 0.2);
-        }
-        button { 
-            width: 100%; 
-            padding: 12px 20px;
-            background: linear-gradient(135deg, #4db8ff 0%, #2d8bb8 100%); 
-            color: white; 
-            border: none; 
-            border-radius: 8px; 
-            font-weight: 600; 
-            cursor: pointer; 
-            font-size: 0.95em;
-            transition: all 0.3s;
-            box-shadow: 0 4px 15px rgba(77, 184, 255, 0.2);
-        }
-        button:hover { 
-            transform: translateY(-2px);
-            box-shadow: 0 6px 20px rgba(77, 184, 255, 0.4);
-        }
-        button:active { 
-            transform: translateY(0);
-        }
-        .message { 
-            padding: 12px 15px; 
-            border-radius: 8px; 
-            margin-top: 12px; 
-            font-size: 0.9em; 
-            display: none;
-            border-left: 4px solid;
-            animation: slideIn 0.3s ease;
-        }
-        @keyframes slideIn {
-            from { transform: translateX(-20px); opacity: 0; }
-            to { transform: translateX(0); opacity: 1; }
-        }
-        .message.success { 
-            background: rgba(30, 70, 32, 0.8); 
-            color: #81c784; 
-            border-color: #4caf50;
-            display: block;
-        }
-        .message.error { 
-            background: rgba(74, 31, 31, 0.8); 
-            color: #ef5350; 
-            border-color: #ff6b6b;
-            display: block;
-        }
-        .info-box { 
-            background: rgba(31, 58, 90, 0.6);
-            border-left: 4px solid #4db8ff;
-            padding: 12px 15px; 
-            border-radius: 8px; 
-            color: #90caf9; 
-            font-size: 0.85em;
-            margin-top: 12px;
-            line-height: 1.6;
-        }
-        .status-badge {
-            display: inline-block;
-            padding: 8px 15px;
-            border-radius: 20px;
-            font-size: 0.9em;
-            font-weight: 600;
-            margin-top: 12px;
-        }
-        .status-connected {
-            background: rgba(30, 70, 32, 0.8);
-            color: #4caf50;
-            border: 1px solid #4caf50;
-        }
-        .status-disconnected {
-            background: rgba(74, 31, 31, 0.8);
-            color: #ff6b6b;
-            border: 1px solid #ff6b6b;
-        }
-        .status-info {
-            font-size: 0.85em;
-            color: #aaa;
-            margin-top: 8px;
-        }
-        .api-grid {
-            display: grid;
-            grid-template-columns: 1fr;
-            gap: 12px;
-        }
-        .endpoint {
-            background: rgba(60, 60, 60, 0.5);
-            padding: 12px;
-            border-radius: 6px;
-            border-left: 3px solid;
-            font-size: 0.85em;
-            font-family: 'Courier New', monospace;
-        }
-        .endpoint.get {
-            border-left-color: #4caf50;
-        }
-        .endpoint.post {
-            border-left-color: #ff9800;
-        }
-        .method {
-            display: inline-block;
-            padding: 3px 8px;
-            border-radius: 4px;
-            font-weight: 600;
-            font-size: 0.75em;
-            margin-right: 8px;
-        }
-        .method.get {
-            background: rgba(76, 175, 80, 0.2);
-            color: #4caf50;
-        }
-        .method.post {
-            background: rgba(255, 152, 0, 0.2);
-            color: #ff9800;
-        }
-        .endpoint-desc {
-            display: block;
-            color: #90caf9;
-            margin-top: 4px;
-        }
-        .full-width {
-            grid-column: 1 / -1;
-        }
-        .button-group {
-            display: flex;
-            gap: 10px;
-        }
-        .button-group button {
-            flex: 1;
-        }
-    </style>
-</head>
-<body>
-    <div class="container">
-        <header>
-            <h1>⚙️ AirBox Control</h1>
-            <p class="subtitle">ESP32 Relay Management System</p>
-        </header>
-
-        <div class="grid">
-            <!-- WiFi Status -->
-            <div class="section">
-                <h2>📡 WiFi Status</h2>
-                <div id="wifi-status"></div>
-            </div>
-
-            <!-- Relay Control -->
-            <div class="section">
-                <h2>🔌 Quick Relay Control</h2>
-                <div class="form-group">
-                    <label for="relay-select">Select Relay</label>
-                    <select id="relay-select">
-                        <option value="0">Relay 1</option>
-                        <option value="1">Relay 2</option>
-                        <option value="2">Relay 3</option>
-                        <option value="3">Relay 4</option>
-                    </select>
-                </div>
-                <div class="button-group">
-                    <button onclick="setRelay(1)" style="background: linear-gradient(135deg, #4caf50 0%, #388e3c 100%);">ON</button>
-                    <button onclick="setRelay(0)" style="background: linear-gradient(135deg, #f44336 0%, #d32f2f 100%);">OFF</button>
-                </div>
-                <div id="relay-message" class="message"></div>
-            </div>
-
-            <!-- WiFi Configuration -->
-            <div class="section full-width">
-                <h2>🌐 WiFi Configuration</h2>
-                <div class="form-group">
-                    <label for="ssid">WiFi SSID</label>
-                    <input type="text" id="ssid" placeholder="Enter network name">
-                </div>
-                <div class="form-group">
-                    <label for="password">Password</label>
-                    <input type="password" id="password" placeholder="Enter password">
-                </div>
-                <div class="button-group">
-                    <button onclick="saveWiFi()" style="background: linear-gradient(135deg, #4db8ff 0%, #2d8bb8 100%);">Connect to WiFi</button>
-                    <button onclick="resetWiFi()" style="background: linear-gradient(135deg, #ff6b6b 0%, #cc5555 100%);">Reset to AP Mode</button>
-                </div>
-                <div id="wifi-message" class="message"></div>
-                <div class="info-box">WiFi changes will restart the device automatically.</div>
-            </div>
-
-            <!-- Firmware Upload -->
-            <div class="section full-width">
-                <h2>📦 Firmware Upload</h2>
-                <div class="form-group">
-                    <label for="firmware-file">Select firmware file (.bin)</label>
-                    <input type="file" id="firmware-file" accept=".bin">
-                </div>
-                <button onclick="uploadFirmware()" style="background: linear-gradient(135deg, #ff9800 0%, #f57c00 100%);">Upload Firmware</button>
-                <div id="firmware-message" class="message"></div>
-                <div class="info-box">Upload a new firmware binary file to update the device. The device will restart after upload.</div>
-            </div>
-
-            <!-- API Documentation -->
-            <div class="section full-width">
-                <h2>📚 API Endpoints</h2>
-                <div class="api-grid">
-                    <div class="endpoint get">
-                        <span class="method get">GET</span>
-                        <strong>/state</strong>
-                        <span class="endpoint-desc">Get current relay states</span>
-                    </div>
-                    <div class="endpoint get">
-                        <span class="method get">GET</span>
-                        <strong>/wifi/status</strong>
-                        <span class="endpoint-desc">Get WiFi connection status and signal strength</span>
-                    </div>
-                    <div class="endpoint post">
-                        <span class="method post">POST</span>
-                        <strong>/relay/set</strong>
-                        <span class="endpoint-desc">Control relay - JSON: {"relay": 0-3, "state": 0|1}</span>
-                    </div>
-                    <div class="endpoint get">
-                        <span class="method get">GET</span>
-                        <strong>/relay/multi?relay=0,2&state=1,0</strong>
-                        <span class="endpoint-desc">Control multiple relays at once</span>
-                    </div>
-                    <div class="endpoint post">
-                        <span class="method post">POST</span>
-                        <strong>/wifi/config</strong>
-                        <span class="endpoint-desc">Configure WiFi - JSON: {"ssid": "...", "password": "..."}</span>
-                    </div>
-                    <div class="endpoint post">
-                        <span class="method post">POST</span>
-                        <strong>/firmware/upload</strong>
-                        <span class="endpoint-desc">Upload new firmware - multipart/form-data with 'firmware' field</span>
-                    </div>
-                </div>
-            </div>
-        </div>
-    </div>
-
-    <script>
-        function updateWiFiStatus() {
-            fetch('/wifi/status')
-                .then(r => r.json())
-                .then(d => {
-                    var statusHtml = '';
-                    if (d.connected) {
-                        statusHtml = '<div class="status-badge status-connected">✓ Connected</div>';
-                        statusHtml += '<div class="status-info">Network: <strong>' + d.ssid + '</strong><br>IP: ' + d.ip + '<br>Signal: ' + d.rssi + ' dBm</div>';
-                    } else {
-                        statusHtml = '<div class="status-badge status-disconnected">⚠ AP Mode</div>';
-                        statusHtml += '<div class="status-info">IP: 192.168.4.1<br>SSID: AirBox</div>';
-                    }
-                    document.getElementById('wifi-status').innerHTML = statusHtml;
-                })
-                .catch(e => {
-                    document.getElementById('wifi-status').innerHTML = '<div class="status-badge status-disconnected">✗ Error</div>';
-                });
-        }
-
-        function setRelay(state) {
-            var relay = document.getElementById('relay-select').value;
-            var msg = document.getElementById('relay-message');
-
-            fetch('/relay/set', {
-                method: 'POST',
-                headers: { 'Content-Type': 'application/json' },
-                body: JSON.stringify({ relay: parseInt(relay), state: state })
-            })
-                .then(r => r.json())
-                .then(d => {
-                    if (d.success) {
-                        msg.className = 'message success';
-                        msg.textContent = 'Relay ' + (parseInt(relay) + 1) + ' is now ' + (state ? 'ON' : 'OFF');
-                    } else {
-                        msg.className = 'message error';
-                        msg.textContent = 'Error controlling relay';
+bool wifi_sta_pending = false;
+unsigned long wifi_sta_started = 0;
+bool spiffs_pending = true;
+
+// Boot phase timestamps, in microseconds since the app started (micros()
+// does not count the ROM and second-stage bootloader)
+struct BootMark {
+    const char *phase;
+    uint32_t us;
+};
+BootMark boot_marks[BOOT_MARKS_MAX];
+int boot_mark_count = 0;
+uint32_t boot_app_start_us = 0;     // estimated reset-to-app-start time
+bool boot_log_live = false;
+bool boot_first_request = false;
+
+// Serialized /state, rebuilt only when relay_states actually change
+uint32_t state_version = 0;
+// Random per boot and part of every ETag / wait token, so a tag from before a
+// restart never matches a version number that has started over
+uint32_t state_boot_id = 0;
+uint8_t state_snapshot_relays[4] = {0, 0, 0, 0};
+uint8_t state_snapshot_faults[4] = {0, 0, 0, 0};
+char *state_json = NULL;
+uint8_t state_cbor[64];
+size_t state_cbor_len = 0;
+// Strong validators differ per representation: "<boot id>-<version>" for
+// JSON, with a "-c" suffix for CBOR
+char state_etag[24] = "";
+char state_etag_cbor[24] = "";
+
+// Long-poll clients parked on GET /state?wait=<version>
+struct StateWaiter {
+    WiFiClient client;
+    uint32_t version;
+    unsigned long since;
+    unsigned long timeout;
+    bool cbor;
+    bool active;
+};
+StateWaiter state_waiters[STATE_WAITERS_MAX];
+
+// Modbus TCP masters, each with a partial-frame buffer
+struct ModbusClient {
+    WiFiClient client;
+    uint8_t buf[MODBUS_FRAME_MAX];
+    size_t len;
+    unsigned long last_seen;
+};
+ModbusClient modbus_clients[MODBUS_CLIENTS_MAX];
+
+// Raw POST body of the current request, collected by handle_request_body()
+uint8_t request_body[REQUEST_BODY_MAX];
+size_t request_body_len = 0;
+bool request_body_overflow = false;
+
+// Per-client token buckets, in thousandths of a request
+enum RateClass {
+    RATE_READ,
+    RATE_CONTROL
+};
+const uint32_t rate_burst[] = {AIRBOX_RATE_LIMIT_READ_BURST, AIRBOX_RATE_LIMIT_BURST};
+const uint32_t rate_per_sec[] = {AIRBOX_RATE_LIMIT_READ_PER_SEC, AIRBOX_RATE_LIMIT_PER_SEC};
+
+struct RateBucket {
+    uint32_t ip;
+    uint32_t tokens[2];     // indexed by RateClass
+    unsigned long last_seen;
+};
+RateBucket rate_buckets[RATE_LIMIT_CLIENTS];
+
+// Fleet OTA: an image one box verified and now serves to its peers, or the
+// one this box is pulling. Sources are the boxes announcing it over UDP.
+enum FleetState {
+    FLEET_IDLE,
+    FLEET_PULLING,
+    FLEET_SHARING,
+    FLEET_FAILED
+};
+const char *fleet_state_names[] = {"idle", "pulling", "sharing", "failed"};
+
+struct FleetImage {
+    char version[32];   // AIRBOX_FW_VERSION found in the image
+    char app[65];       // hex app_elf_sha256, identifies the build
+    char sha256[65];    // hex SHA-256 of the image bytes as stored in flash
+    uint32_t size;
+};
+
+WiFiUDP fleet_udp;
+volatile FleetState fleet_state = FLEET_IDLE;
+FleetImage fleet_image;
+const esp_partition_t *fleet_partition = NULL;
+uint32_t fleet_sources[FLEET_SOURCES_MAX];
+int fleet_source_count = 0;
+volatile uint32_t fleet_progress = 0;
+unsigned long fleet_ready_at = 0;
+unsigned long fleet_last_served = 0;
+unsigned long fleet_last_announce = 0;
+unsigned long fleet_failed_at = 0;
+unsigned long fleet_restart_delay = 0;
+portMUX_TYPE fleet_mux = portMUX_INITIALIZER_UNLOCKED;
+bool firmware_upload_replied = false;
+// The global Update object serves one writer at a time: an HTTP upload on
+// loop() or a fleet pull on core 0, never both
+bool firmware_upload_active = false;
+bool firmware_upload_rejected = false;
+
+// Tag kept in the image so a box can read the version of a firmware file it
+// received; the esp_app_desc_t version comes from the prebuilt Arduino core
+// and is the same for every sketch
+#define FLEET_VERSION_TAG "AIRBOX-FW:"
+const char fleet_version_tag[] = FLEET_VERSION_TAG AIRBOX_FW_VERSION;
+
+// Streaming search for the version tag across flash reads or pulled chunks
+struct FleetVersionScan {
+    size_t matched;
+    bool in_version;
+    size_t len;
+    char version[32];
+    bool found;
+};
+
+const char *collected_headers[] = {"If-None-Match", "Accept-Language", "Accept", "Accept-Encoding", "Content-Type"};
+
+
+// CORS helpers
+void addCorsHeaders() {
+    server.sendHeader("Access-Control-Allow-Origin", "*");
+    server.sendHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+    server.sendHeader("Access-Control-Allow-Headers", "Content-Type, If-None-Match");
+}
+
+void handle_options() {
+    addCorsHeaders();
+    server.send(204);
+}
+
+void register_options(const char* path) {
+    server.on(path, HTTP_OPTIONS, handle_options);
+}
+
+// Boot profiling
+void print_boot_mark(const BootMark &mark) {
+    Serial.printf("[Boot] %-14s %lu.%03lu ms\n", mark.phase,
+        (unsigned long)(mark.us / 1000), (unsigned long)(mark.us % 1000));
+}
+
+// Marks taken before Serial is up are held back until boot_log_flush()
+void boot_mark(const char *phase) {
+    if (boot_mark_count >= BOOT_MARKS_MAX) {
+        return;
+    }
+    BootMark &mark = boot_marks[boot_mark_count++];
+    mark.phase = phase;
+    mark.us = micros();
+    if (boot_log_live) {
+        print_boot_mark(mark);
+    }
+}
+
+// The CPU cycle counter runs from reset and IDF rescales it whenever it
+// switches the CPU clock, so cycles / MHz is the time since reset. It wraps
+// after ~18 s at 240 MHz, long after setup() is reached.
+void boot_measure_app_start() {
+    uint32_t since_reset_us = ESP.getCycleCount() / getCpuFrequencyMhz();
+    uint32_t since_app_us = micros();
+    boot_app_start_us = since_reset_us > since_app_us ? since_reset_us - since_app_us : 0;
+}
+
+void boot_log_flush() {
+    Serial.printf("[Boot] app start      %lu.%03lu ms after reset\n",
+        (unsigned long)(boot_app_start_us / 1000), (unsigned long)(boot_app_start_us % 1000));
+    for (int i = 0; i < boot_mark_count; i++) {
+        print_boot_mark(boot_marks[i]);
+    }
+    boot_log_live = true;
+}
+
+// Relay control
+void write_relay_output(int idx) {
+    relay_outputs[idx] = relay_states[idx];
+    relay_changed_at[idx] = millis();
+    digitalWrite(relay_pins[idx], !relay_outputs[idx]);
+}
+
+// Records the commanded state. The pin is only written when the level really
+// changes, and at most once per dwell window, so on/off bursts collapse into
+// the last command (see service_relays).
+void set_relay(int idx, uint8_t state) {
+    relay_states[idx] = state ? 1 : 0;
+    if (!(relay_batch_mask & (1 << idx)) && relay_states[idx] != relay_outputs[idx] &&
+        millis() - relay_changed_at[idx] >= RELAY_MIN_DWELL_MS) {
+        write_relay_output(idx);
+    }
+}
+
+bool relay_batch_ready(uint8_t mask) {
+    for (int i = 0; i < 4; i++) {
+        if ((mask & (1 << i)) && millis() - relay_changed_at[i] < RELAY_MIN_DWELL_MS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void write_relay_batch(uint8_t mask) {
+    for (int i = 0; i < 4; i++) {
+        if ((mask & (1 << i)) && relay_states[i] != relay_outputs[i]) {
+            write_relay_output(i);
+        }
+    }
+}
+
+// Sets the relays in mask as one unit: if any relay that has to change is
+// still inside its dwell window, all of them wait and switch together.
+void set_relays(uint8_t mask, const uint8_t *states) {
+    uint8_t changing = relay_batch_mask;
+    for (int i = 0; i < 4; i++) {
+        if (mask & (1 << i)) {
+            relay_states[i] = states[i] ? 1 : 0;
+            if (relay_states[i] != relay_outputs[i]) {
+                changing |= 1 << i;
+            }
+        }
+    }
+    if (relay_batch_ready(changing)) {
+        write_relay_batch(changing);
+        relay_batch_mask = 0;
+    } else {
+        relay_batch_mask = changing;
+    }
+}
+
+void service_relays() {
+    if (relay_batch_mask && relay_batch_ready(relay_batch_mask)) {
+        write_relay_batch(relay_batch_mask);
+        relay_batch_mask = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (!(relay_batch_mask & (1 << i)) && relay_states[i] != relay_outputs[i] &&
+            millis() - relay_changed_at[i] >= RELAY_MIN_DWELL_MS) {
+            write_relay_output(i);
+        }
+    }
+}
+
+// Admission control
+void note_request() {
+    if (!boot_first_request) {
+        boot_first_request = true;
+        boot_mark("first_request");
+    }
+}
+
+// Charges one token of the given class to the calling client; when that
+// bucket is empty, answers 429 and returns false.
+bool admit_request(RateClass cls) {
+    note_request();
+    
+    uint32_t ip = server.client().remoteIP();
+    unsigned long now = millis();
+    
+    RateBucket *bucket = NULL;
+    RateBucket *oldest = &rate_buckets[0];
+    for (int i = 0; i < RATE_LIMIT_CLIENTS; i++) {
+        if (rate_buckets[i].ip == ip) {
+            bucket = &rate_buckets[i];
+            break;
+        }
+        if (rate_buckets[i].last_seen < oldest->last_seen) {
+            oldest = &rate_buckets[i];
+        }
+    }
+    if (!bucket) {
+        bucket = oldest;
+        bucket->ip = ip;
+        for (int c = RATE_READ; c <= RATE_CONTROL; c++) {
+            bucket->tokens[c] = rate_burst[c] * 1000;
+        }
+    } else {
+        for (int c = RATE_READ; c <= RATE_CONTROL; c++) {
+            unsigned long elapsed = min(now - bucket->last_seen, (unsigned long)(rate_burst[c] * 1000 / rate_per_sec[c]));
+            bucket->tokens[c] = min(rate_burst[c] * 1000, (uint32_t)(bucket->tokens[c] + elapsed * rate_per_sec[c]));
+        }
+    }
+    bucket->last_seen = now;
+    
+    uint32_t &tokens = bucket->tokens[cls];
+    if (tokens >= 1000) {
+        tokens -= 1000;
+        return true;
+    }
+    
+    uint32_t wait_ms = (1000 - tokens) / rate_per_sec[cls];
+    addCorsHeaders();
+    server.sendHeader("Retry-After", String((unsigned long)(wait_ms + 999) / 1000));
+    server.sendHeader("Access-Control-Expose-Headers", "Retry-After");
+    server.send(429, "application/json", "{\"error\":\"Too many requests\"}");
+    return false;
+}
+
+// CBOR (RFC 8949), negotiated with Accept / Content-Type: application/cbor
+struct CborWriter {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    bool overflow;
+};
+
+void cbor_put_bytes(CborWriter &w, const void *data, size_t n) {
+    if (w.len + n > w.cap) {
+        w.overflow = true;
+        return;
+    }
+    memcpy(w.buf + w.len, data, n);
+    w.len += n;
+}
+
+void cbor_put_head(CborWriter &w, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    size_t n;
+    if (value < 24) {
+        head[0] = (major << 5) | value;
+        n = 1;
+    } else if (value <= 0xFF) {
+        head[0] = (major << 5) | 24;
+        n = 2;
+    } else if (value <= 0xFFFF) {
+        head[0] = (major << 5) | 25;
+        n = 3;
+    } else if (value <= 0xFFFFFFFF) {
+        head[0] = (major << 5) | 26;
+        n = 5;
+    } else {
+        head[0] = (major << 5) | 27;
+        n = 9;
+    }
+    for (size_t i = 1; i < n; i++) {
+        head[i] = value >> (8 * (n - 1 - i));
+    }
+    cbor_put_bytes(w, head, n);
+}
+
+void cbor_put_text(CborWriter &w, const char *text) {
+    size_t n = strlen(text);
+    cbor_put_head(w, 3, n);
+    cbor_put_bytes(w, text, n);
+}
+
+void cbor_put_item(CborWriter &w, const cJSON *item) {
+    const cJSON *child;
+    if (cJSON_IsObject(item) || cJSON_IsArray(item)) {
+        bool is_object = cJSON_IsObject(item);
+        cbor_put_head(w, is_object ? 5 : 4, cJSON_GetArraySize(item));
+        cJSON_ArrayForEach(child, item) {
+            if (is_object) {
+                cbor_put_text(w, child->string);
+            }
+            cbor_put_item(w, child);
+        }
+    } else if (cJSON_IsString(item)) {
+        cbor_put_text(w, item->valuestring);
+    } else if (cJSON_IsNumber(item)) {
+        double d = item->valuedouble;
+        if (d == floor(d) && fabs(d) < 9.0e15) {
+            int64_t v = (int64_t)d;
+            if (v >= 0) {
+                cbor_put_head(w, 0, v);
+            } else {
+                cbor_put_head(w, 1, -1 - v);
+            }
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            cbor_put_head(w, 7, bits);
+        }
+    } else if (cJSON_IsBool(item)) {
+        cbor_put_head(w, 7, cJSON_IsTrue(item) ? 21 : 20);
+    } else {
+        cbor_put_head(w, 7, 22);
+    }
+}
+
+// Returns the encoded length, or 0 if it does not fit in cap
+size_t cbor_encode(const cJSON *root, uint8_t *buf, size_t cap) {
+    CborWriter w = {buf, cap, 0, false};
+    cbor_put_item(w, root);
+    return w.overflow ? 0 : w.len;
+}
+
+bool cbor_read_head(const uint8_t *&p, const uint8_t *end, uint8_t &major, uint8_t &info, uint64_t &value) {
+    if (p >= end) {
+        return false;
+    }
+    major = *p >> 5;
+    info = *p & 0x1F;
+    p++;
+    if (info < 24) {
+        value = info;
+        return true;
+    }
+    if (info > 27) {
+        return false;  // indefinite lengths are not supported
+    }
+    size_t n = 1 << (info - 24);
+    if ((size_t)(end - p) < n) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < n; i++) {
+        value = (value << 8) | *p++;
+    }
+    return true;
+}
+
+double cbor_half_to_double(uint16_t h) {
+    int exp = (h >> 10) & 0x1F;
+    int mant = h & 0x3FF;
+    double v;
+    if (exp == 0) {
+        v = ldexp(mant, -24);
+    } else if (exp != 31) {
+        v = ldexp(mant + 1024, exp - 25);
+    } else {
+        v = mant == 0 ? INFINITY : NAN;
+    }
+    return (h & 0x8000) ? -v : v;
+}
+
+cJSON *cbor_decode_item(const uint8_t *&p, const uint8_t *end, int depth) {
+    uint8_t major, info;
+    uint64_t value;
+    if (depth > CBOR_MAX_DEPTH || !cbor_read_head(p, end, major, info, value)) {
+        return NULL;
+    }
+    
+    switch (major) {
+        case 0:
+            return cJSON_CreateNumber((double)value);
+        case 1:
+            return cJSON_CreateNumber(-1.0 - (double)value);
+        case 3: {
+            if (value > (uint64_t)(end - p)) {
+                return NULL;
+            }
+            String text;
+            text.reserve(value);
+            for (uint64_t i = 0; i < value; i++) {
+                text += (char)p[i];
+            }
+            p += value;
+            return cJSON_CreateString(text.c_str());
+        }
+        case 4:
+        case 5: {
+            cJSON *container = major == 5 ? cJSON_CreateObject() : cJSON_CreateArray();
+            for (uint64_t i = 0; i < value; i++) {
+                cJSON *key = NULL;
+                if (major == 5) {
+                    key = cbor_decode_item(p, end, depth + 1);
+                    if (!cJSON_IsString(key)) {
+                        cJSON_Delete(key);
+                        cJSON_Delete(container);
+                        return NULL;
                     }
-                    setTimeout(() => msg.style.display = 'none', 3000);
-                })
-                .catch(e => {
-                    msg.className = 'message error';
-                    msg.textContent = 'Error: ' + e;
-                    setTimeout(() => msg.style.display = 'none', 3000);
-                });
-        }
-
-        function saveWiFi() {
-            var ssid = document.getElementById('ssid').value;
-            var pwd = document.getElementById('password').value;
-            var msg = document.getElementById('wifi-message');
-
-            if (!ssid || !pwd) {
-                msg.className = 'message error';
-                msg.textContent = 'SSID and password required';
+                }
+                cJSON *child = cbor_decode_item(p, end, depth + 1);
+                if (!child) {
+                    cJSON_Delete(key);
+                    cJSON_Delete(container);
+                    return NULL;
+                }
+                if (key) {
+                    cJSON_AddItemToObject(container, key->valuestring, child);
+                    cJSON_Delete(key);
+                } else {
+                    cJSON_AddItemToArray(container, child);
+                }
+            }
+            return container;
+        }
+        case 7:
+            if (info == 20 || info == 21) {
+                return cJSON_CreateBool(info == 21);
+            } else if (info == 22) {
+                return cJSON_CreateNull();
+            } else if (info == 25) {
+                return cJSON_CreateNumber(cbor_half_to_double(value));
+            } else if (info == 26) {
+                uint32_t bits = value;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                return cJSON_CreateNumber(f);
+            } else if (info == 27) {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                return cJSON_CreateNumber(d);
+            }
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
+cJSON *cbor_decode(const uint8_t *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    cJSON *root = cbor_decode_item(p, end, 0);
+    if (root && p != end) {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+bool wants_cbor() {
+    return server.header("Accept").indexOf("application/cbor") >= 0;
+}
+
+// Raw body callback for POST routes. WebServer would otherwise hand the body
+// over as the "plain" arg, a C string that stops at the first zero byte, and
+// CBOR encodes every integer 0 as 0x00.
+void handle_request_body() {
+    HTTPRaw &raw = server.raw();
+    if (raw.status == RAW_START) {
+        request_body_len = 0;
+        request_body_overflow = false;
+    } else if (raw.status == RAW_WRITE) {
+        if (request_body_len + raw.currentSize > sizeof(request_body)) {
+            request_body_overflow = true;
+        } else {
+            memcpy(request_body + request_body_len, raw.buf, raw.currentSize);
+            request_body_len += raw.currentSize;
+        }
+    }
+}
+
+// Parses the request body as CBOR or JSON depending on Content-Type
+cJSON *parse_request_body() {
+    size_t len = request_body_len;
+    request_body_len = 0;
+    if (request_body_overflow || len == 0 || len != server.clientContentLength()) {
+        return NULL;
+    }
+    if (server.header("Content-Type").startsWith("application/cbor")) {
+        return cbor_decode(request_body, len);
+    }
+    return cJSON_ParseWithLength((const char *)request_body, len);
+}
+
+// Sends root as CBOR or pretty JSON depending on Accept, then frees it
+void send_reply(int code, cJSON *root) {
+    server.sendHeader("Vary", "Accept");
+    if (wants_cbor()) {
+        uint8_t buf[CBOR_REPLY_MAX];
+        size_t len = cbor_encode(root, buf, sizeof(buf));
+        cJSON_Delete(root);
+        if (len == 0) {
+            server.send(500);
+            return;
+        }
+        server.send_P(code, "application/cbor", (const char *)buf, len);
+        return;
+    }
+    char *json_str = cJSON_Print(root);
+    server.send(code, "application/json", json_str);
+    free(json_str);
+    cJSON_Delete(root);
+}
+
+void send_success(int code, int success) {
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddNumberToObject(response, "success", success);
+    send_reply(code, response);
+}
+
+// Language negotiation
+int find_web_page(const char *lang, size_t len) {
+    for (int i = 0; i < WEB_PAGE_COUNT; i++) {
+        if (strlen(web_pages[i].lang) == len && strncasecmp(web_pages[i].lang, lang, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Picks the supported language with the highest q-value, e.g. "fr-CH, fr;q=0.9, en;q=0.8"
+int negotiate_web_page(const char *accept) {
+    int best = WEB_PAGE_DEFAULT;
+    int best_q = 0;
+    
+    while (*accept) {
+        while (*accept == ' ' || *accept == ',') {
+            accept++;
+        }
+        const char *tag = accept;
+        while (*accept && *accept != '-' && *accept != ';' && *accept != ',' && *accept != ' ') {
+            accept++;
+        }
+        int idx = find_web_page(tag, accept - tag);
+        
+        int q = 1000;
+        while (*accept && *accept != ',') {
+            if (accept[0] == 'q' && accept[1] == '=') {
+                q = (int)(atof(accept + 2) * 1000);
+            }
+            accept++;
+        }
+        if (idx >= 0 && q > best_q) {
+            best = idx;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+// The pages are stored gzipped only. No header at all means any coding is
+// fine; otherwise gzip (or x-gzip, or *) must be listed with a non-zero q.
+bool accepts_gzip(const char *accept) {
+    if (!*accept) {
+        return true;
+    }
+    
+    int gzip_q = -1;
+    int any_q = 0;
+    while (*accept) {
+        while (*accept == ' ' || *accept == ',') {
+            accept++;
+        }
+        const char *coding = accept;
+        while (*accept && *accept != ';' && *accept != ',' && *accept != ' ') {
+            accept++;
+        }
+        size_t len = accept - coding;
+        bool gzip = (len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+                    (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0);
+        bool any = len == 1 && coding[0] == '*';
+        
+        int q = 1000;
+        while (*accept && *accept != ',') {
+            if (accept[0] == 'q' && accept[1] == '=') {
+                q = (int)(atof(accept + 2) * 1000);
+            }
+            accept++;
+        }
+        if (gzip) {
+            gzip_q = q;
+        } else if (any) {
+            any_q = q;
+        }
+    }
+    // An explicit gzip entry wins over the wildcard
+    return (gzip_q >= 0 ? gzip_q : any_q) > 0;
+}
+
+void handle_root() {
+    if (!admit_request(RATE_READ)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    server.sendHeader("Vary", "Accept-Language, Accept-Encoding");
+    if (!accepts_gzip(server.header("Accept-Encoding").c_str())) {
+        server.send(406, "text/plain", "This page is only available gzip-encoded\n");
+        return;
+    }
+    
+    int page = -1;
+    if (server.hasArg("lang")) {
+        String lang = server.arg("lang");
+        page = find_web_page(lang.c_str(), lang.length());
+    }
+    if (page < 0) {
+        page = negotiate_web_page(server.header("Accept-Language").c_str());
+    }
+    
+    server.sendHeader("Content-Encoding", "gzip");
+    server.sendHeader("Content-Language", web_pages[page].lang);
+    server.send_P(200, "text/html", (const char *)web_pages[page].data, web_pages[page].len);
+}
+
+// State snapshot
+void notify_state_waiters();
+
+void refresh_state_snapshot() {
+    if (state_json && memcmp(state_snapshot_relays, relay_states, sizeof(relay_states)) == 0 &&
+        memcmp(state_snapshot_faults, relay_faults, sizeof(relay_faults)) == 0) {
+        return;
+    }
+    
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "in1", relay_states[0]);
+    cJSON_AddNumberToObject(root, "in2", relay_states[1]);
+    cJSON_AddNumberToObject(root, "in3", relay_states[2]);
+    cJSON_AddNumberToObject(root, "in4", relay_states[3]);
+#if AIRBOX_CURRENT_SENSE
+    // Only where they can be non-zero; they double the size of every poll
+    cJSON_AddNumberToObject(root, "fault1", relay_faults[0]);
+    cJSON_AddNumberToObject(root, "fault2", relay_faults[1]);
+    cJSON_AddNumberToObject(root, "fault3", relay_faults[2]);
+    cJSON_AddNumberToObject(root, "fault4", relay_faults[3]);
+#endif
+    char *json_str = cJSON_Print(root);
+    size_t cbor_len = cbor_encode(root, state_cbor, sizeof(state_cbor));
+    cJSON_Delete(root);
+    if (!json_str) {
+        return;
+    }
+    
+    free(state_json);
+    state_json = json_str;
+    state_cbor_len = cbor_len;
+    memcpy(state_snapshot_relays, relay_states, sizeof(relay_states));
+    memcpy(state_snapshot_faults, relay_faults, sizeof(relay_faults));
+    state_version++;
+    snprintf(state_etag, sizeof(state_etag), "\"%08lx-%lu\"", (unsigned long)state_boot_id, (unsigned long)state_version);
+    snprintf(state_etag_cbor, sizeof(state_etag_cbor), "\"%08lx-%lu-c\"", (unsigned long)state_boot_id, (unsigned long)state_version);
+    
+    notify_state_waiters();
+}
+
+void send_state_to_client(WiFiClient &client, bool modified, bool cbor) {
+    char head[256];
+    const uint8_t *body = cbor ? state_cbor : (const uint8_t *)state_json;
+    size_t body_len = !modified ? 0 : cbor ? state_cbor_len : strlen(state_json);
+    int len = snprintf(head, sizeof(head),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "ETag: %s\r\n"
+        "Vary: Accept\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Expose-Headers: ETag\r\n"
+        "Content-Length: %u\r\n"
+        "Connection: close\r\n\r\n",
+        modified ? "200 OK" : "304 Not Modified", cbor ? "application/cbor" : "application/json",
+        cbor ? state_etag_cbor : state_etag, (unsigned)body_len);
+    client.write((const uint8_t *)head, len);
+    if (body_len) {
+        client.write(body, body_len);
+    }
+    client.stop();
+}
+
+// Sends the current snapshot in the negotiated encoding
+void send_state_snapshot() {
+    bool cbor = wants_cbor();
+    server.sendHeader("ETag", cbor ? state_etag_cbor : state_etag);
+    server.sendHeader("Access-Control-Expose-Headers", "ETag");
+    server.sendHeader("Vary", "Accept");
+    if (cbor) {
+        server.send_P(200, "application/cbor", (const char *)state_cbor, state_cbor_len);
+    } else {
+        server.send(200, "application/json", state_json);
+    }
+}
+
+void notify_state_waiters() {
+    for (int i = 0; i < STATE_WAITERS_MAX; i++) {
+        StateWaiter &w = state_waiters[i];
+        if (w.active && w.version != state_version) {
+            send_state_to_client(w.client, true, w.cbor);
+            w.active = false;
+        }
+    }
+}
+
+void service_state_waiters() {
+    for (int i = 0; i < STATE_WAITERS_MAX; i++) {
+        StateWaiter &w = state_waiters[i];
+        if (!w.active) {
+            continue;
+        }
+        if (!w.client.connected()) {
+            w.client.stop();
+            w.active = false;
+        } else if (millis() - w.since >= w.timeout) {
+            send_state_to_client(w.client, false, w.cbor);
+            w.active = false;
+        }
+    }
+}
+
+// Accepts either ETag value, with or without quotes: "<boot id>-<version>[-c]"
+bool state_wait_matches(const String &token) {
+    const char *p = token.c_str();
+    if (*p == '"') {
+        p++;
+    }
+    char *end;
+    uint32_t boot_id = strtoul(p, &end, 16);
+    if (*end != '-') {
+        return false;
+    }
+    uint32_t version = strtoul(end + 1, NULL, 10);
+    return boot_id == state_boot_id && version == state_version;
+}
+
+int state_waiters_allowed() {
+    int allowed = CONFIG_LWIP_MAX_SOCKETS - STATE_SOCKETS_RESERVED;
+    for (int i = 0; i < MODBUS_CLIENTS_MAX; i++) {
+        if (modbus_clients[i].client.connected()) {
+            allowed--;
+        }
+    }
+    return min(allowed, STATE_WAITERS_MAX);
+}
+
+bool park_state_waiter(uint32_t version, unsigned long timeout) {
+    int parked = 0;
+    for (int i = 0; i < STATE_WAITERS_MAX; i++) {
+        parked += state_waiters[i].active;
+    }
+    if (parked >= state_waiters_allowed()) {
+        return false;
+    }
+    
+    for (int i = 0; i < STATE_WAITERS_MAX; i++) {
+        StateWaiter &w = state_waiters[i];
+        if (!w.active) {
+            // WiFiClient copies share the socket, so this one keeps it open
+            // after WebServer lets go of the request without a reply.
+            w.client = server.client();
+            w.version = version;
+            w.since = millis();
+            w.timeout = timeout;
+            w.cbor = wants_cbor();
+            w.active = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parked long-polls and 304s are not charged to the rate limit; only a full
+// reply is
+void handle_state() {
+    note_request();
+    
+    if (server.hasArg("wait") && state_wait_matches(server.arg("wait"))) {
+        unsigned long timeout = STATE_WAIT_DEFAULT_MS;
+        if (server.hasArg("timeout")) {
+            timeout = strtoul(server.arg("timeout").c_str(), NULL, 10);
+            if (timeout > STATE_WAIT_MAX_MS) {
+                timeout = STATE_WAIT_MAX_MS;
+            }
+        }
+        if (timeout > 0) {
+            if (park_state_waiter(state_version, timeout)) {
+                return;
+            }
+            // Answering at once would only bring the client straight back
+            addCorsHeaders();
+            server.sendHeader("Retry-After", String(STATE_WAIT_RETRY_S));
+            server.sendHeader("Access-Control-Expose-Headers", "Retry-After");
+            server.send(503, "application/json", "{\"error\":\"Too many waiting clients\"}");
+            return;
+        }
+    }
+    
+    const char *etag = wants_cbor() ? state_etag_cbor : state_etag;
+    if (server.header("If-None-Match") == etag) {
+        addCorsHeaders();
+        server.sendHeader("ETag", etag);
+        server.sendHeader("Access-Control-Expose-Headers", "ETag");
+        server.sendHeader("Vary", "Accept");
+        server.send(304);
+        return;
+    }
+    
+    if (!admit_request(RATE_READ)) {
+        return;
+    }
+    addCorsHeaders();
+    send_state_snapshot();
+}
+
+void handle_relay_multi() {
+    if (!admit_request(RATE_CONTROL)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    if (server.hasArg("relay") && server.hasArg("state")) {
+        String relayStr = server.arg("relay");
+        String stateStr = server.arg("state");
+        
+        char relayBuf[50], stateBuf[50];
+        strncpy(relayBuf, relayStr.c_str(), sizeof(relayBuf) - 1);
+        relayBuf[sizeof(relayBuf) - 1] = '\0';
+        strncpy(stateBuf, stateStr.c_str(), sizeof(stateBuf) - 1);
+        stateBuf[sizeof(stateBuf) - 1] = '\0';
+        
+        // Walk both lists in step; the batch is applied only if every pair is
+        // valid and the lists have the same length
+        int relayCount = 0;
+        uint8_t mask = 0;
+        uint8_t states[4] = {0, 0, 0, 0};
+        char *relaySave = NULL;
+        char *stateSave = NULL;
+        char *relayToken = strtok_r(relayBuf, ",", &relaySave);
+        char *stateToken = strtok_r(stateBuf, ",", &stateSave);
+        bool valid = relayToken != NULL;
+        while (valid && relayToken && stateToken) {
+            int idx = atoi(relayToken);
+            if (idx < 0 || idx > 3 || ++relayCount > 4) {
+                valid = false;
+                break;
+            }
+            mask |= 1 << idx;
+            states[idx] = atoi(stateToken);
+            relayToken = strtok_r(NULL, ",", &relaySave);
+            stateToken = strtok_r(NULL, ",", &stateSave);
+        }
+        if (!valid || relayToken || stateToken) {
+            cJSON *response = cJSON_CreateObject();
+            cJSON_AddStringToObject(response, "error", "Invalid parameters");
+            send_reply(400, response);
+            return;
+        }
+        
+        set_relays(mask, states);
+        refresh_state_snapshot();
+        send_state_snapshot();
+        return;
+    }
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "error", "Invalid parameters");
+    send_reply(400, response);
+}
+
+void handle_wifi_status() {
+    if (!admit_request(RATE_CONTROL)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "connected", wifi_connected);
+    cJSON_AddStringToObject(root, "ssid", wifi_ssid_current.c_str());
+    cJSON_AddStringToObject(root, "ip", wifi_ip_current.c_str());
+    cJSON_AddNumberToObject(root, "rssi", wifi_rssi);
+    
+    send_reply(200, root);
+}
+
+void handle_relay_set() {
+    if (!admit_request(RATE_CONTROL)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    cJSON *root = parse_request_body();
+    
+    if (root) {
+        cJSON *relay_item = cJSON_GetObjectItem(root, "relay");
+        cJSON *state_item = cJSON_GetObjectItem(root, "state");
+        
+        if (relay_item && state_item) {
+            int relay = relay_item->valueint;
+            uint8_t state = state_item->valueint ? 1 : 0;
+            
+            if (relay >= 0 && relay <= 3) {
+                set_relay(relay, state);
+                refresh_state_snapshot();
+                
+                send_success(200, 1);
+                cJSON_Delete(root);
+                return;
+            }
+        }
+        cJSON_Delete(root);
+    }
+    send_success(400, 0);
+}
+
+void handle_wifi_config() {
+    if (!admit_request(RATE_CONTROL)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    cJSON *root = parse_request_body();
+    
+    if (root) {
+        cJSON *ssid_item = cJSON_GetObjectItem(root, "ssid");
+        cJSON *password_item = cJSON_GetObjectItem(root, "password");
+        
+        if (ssid_item && password_item && ssid_item->valuestring && password_item->valuestring) {
+            preferences.begin("wifi", false);
+            preferences.putString("ssid", ssid_item->valuestring);
+            preferences.putString("password", password_item->valuestring);
+            preferences.end();
+            
+            send_success(200, 1);
+            cJSON_Delete(root);
+            
+            delay(2000);
+            ESP.restart();
+            return;
+        }
+        cJSON_Delete(root);
+    }
+    send_success(400, 0);
+}
+
+void handle_wifi_reset() {
+    if (!admit_request(RATE_CONTROL)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    preferences.begin("wifi", false);
+    preferences.clear();
+    preferences.end();
+    
+    send_success(200, 1);
+    
+    delay(2000);
+    ESP.restart();
+}
+
+void handle_current() {
+    if (!admit_request(RATE_READ)) {
+        return;
+    }
+    
+    CurrentReading readings[CURRENT_CHANNELS];
+#if AIRBOX_CURRENT_SENSE
+    portENTER_CRITICAL(&current_mux);
+    memcpy(readings, current_readings, sizeof(readings));
+    portEXIT_CRITICAL(&current_mux);
+#else
+    memset(readings, 0, sizeof(readings));
+#endif
+    
+    addCorsHeaders();
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "enabled", AIRBOX_CURRENT_SENSE);
+    cJSON *channels = cJSON_AddArrayToObject(root, "channels");
+    for (int i = 0; i < CURRENT_CHANNELS; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "avg_ma", readings[i].avg_ma);
+        cJSON_AddNumberToObject(item, "rms_ma", readings[i].rms_ma);
+        cJSON_AddNumberToObject(item, "faults", relay_faults[i]);
+        cJSON_AddItemToArray(channels, item);
+    }
+    send_reply(200, root);
+}
+
+void handle_boot() {
+    if (!admit_request(RATE_READ)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "fast_boot", AIRBOX_FAST_BOOT);
+    cJSON_AddNumberToObject(root, "app_start_us", boot_app_start_us);
+    cJSON *phases = cJSON_AddArrayToObject(root, "phases");
+    for (int i = 0; i < boot_mark_count; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "phase", boot_marks[i].phase);
+        cJSON_AddNumberToObject(item, "us", boot_marks[i].us);
+        cJSON_AddItemToArray(phases, item);
+    }
+    send_reply(200, root);
+}
+
+bool fleet_share_image(uint32_t size);
+
+void handle_firmware_upload() {
+    addCorsHeaders();
+    
+    HTTPUpload& upload = server.upload();
+    
+    if (upload.status == UPLOAD_FILE_START) {
+        firmware_upload_replied = false;
+        // A fleet pull owns Update, and a shared image must stay intact
+        // until this box restarts into it
+        firmware_upload_rejected = fleet_state == FLEET_PULLING || fleet_state == FLEET_SHARING || Update.isRunning();
+        if (firmware_upload_rejected) {
+            Serial.println("[OTA] Another update is in progress, rejecting upload");
+            return;
+        }
+        firmware_upload_active = true;
+        Serial.printf("[OTA] Update start: %s\n", upload.filename.c_str());
+        if (!Update.begin(UPDATE_SIZE_UNKNOWN)) {
+            Update.printError(Serial);
+        }
+    } else if (upload.status == UPLOAD_FILE_WRITE) {
+        if (firmware_upload_rejected) {
+            return;
+        }
+        if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
+            Update.printError(Serial);
+        }
+    } else if (upload.status == UPLOAD_FILE_END && !firmware_upload_replied) {
+        // Registered as both handler and upload callback, so END arrives twice
+        firmware_upload_replied = true;
+        firmware_upload_active = false;
+        if (firmware_upload_rejected) {
+            cJSON *response = cJSON_CreateObject();
+            cJSON_AddNumberToObject(response, "success", 0);
+            cJSON_AddStringToObject(response, "message", "Another firmware update is in progress");
+            send_reply(409, response);
+            return;
+        }
+        if (Update.end(true)) {
+            Serial.println("[OTA] Update complete!");
+            if (server.hasArg("fleet") && fleet_share_image(upload.totalSize)) {
+                cJSON *response = cJSON_CreateObject();
+                cJSON_AddNumberToObject(response, "success", 1);
+                cJSON_AddStringToObject(response, "message", "Firmware verified, sharing with fleet before restart");
+                send_reply(200, response);
                 return;
             }
-
-            fetch('/wifi/config', {
-                method: 'POST',
-                headers: { 'Content-Type': 'application/json' },
-                body: JSON.stringify({ ssid: ssid, password: pwd })
-            })
-                .then(r => r.json())
-                .then(d => {
-                    if (d.success) {
-                        msg.className = 'message success';
-                        msg.textContent = 'Configuration saved. Device restarting...';
-                        document.getElementById('ssid').value = '';
-                        document.getElementById('password').value = '';
-                    }
-                })
-                .catch(e => {
-                    msg.className = 'message error';
-                    msg.textContent = 'Error: ' + e;
-                });
-        }
-
-        function resetWiFi() {
-            if (confirm('Reset WiFi configuration and restart in AP mode?')) {
-                fetch('/wifi/reset', { method: 'POST' })
-                    .then(r => r.json())
-                    .then(d => {
-                        if (d.success) {
-                            var msg = document.getElementById('wifi-message');
-                            msg.className = 'message success';
-                            msg.textContent = 'WiFi reset. Device restarting to AP mode...';
-                        }
-                    })
-                    .catch(e => alert('Error: ' + e));
-            }
-        }
-
-        function uploadFirmware() {
-            var fileInput = document.getElementById('firmware-file');
-            var file = fileInput.files[0];
-            var msg = document.getElementById('firmware-message');
-
-            if (!file) {
-                msg.className = 'message error';
-                msg.textContent = 'Please select a firmware file';
-                return;
+            cJSON *response = cJSON_CreateObject();
+            cJSON_AddNumberToObject(response, "success", 1);
+            cJSON_AddStringToObject(response, "message", "Firmware updated successfully");
+            char *json_str = cJSON_Print(response);
+            server.send(200, "application/json", json_str);
+            free(json_str);
+            cJSON_Delete(response);
+            
+            delay(2000);
+            ESP.restart();
+        } else {
+            Serial.println("[OTA] Update failed!");
+            cJSON *response = cJSON_CreateObject();
+            cJSON_AddNumberToObject(response, "success", 0);
+            cJSON_AddStringToObject(response, "message", "Firmware update failed");
+            char *json_str = cJSON_Print(response);
+            server.send(500, "application/json", json_str);
+            free(json_str);
+            cJSON_Delete(response);
+        }
+    } else if (upload.status == UPLOAD_FILE_ABORTED) {
+        firmware_upload_replied = true;
+        firmware_upload_active = false;
+        if (!firmware_upload_rejected && Update.isRunning()) {
+            Update.abort();
+        }
+        Update.printError(Serial);
+        server.send(400, "application/json", "{\"success\":0,\"message\":\"Upload aborted\"}");
+    }
+}
+
+// Modbus TCP: coils 0-3 map to relays, input registers expose WiFi/uptime
+#define MODBUS_FC_READ_COILS 0x01
+#define MODBUS_FC_READ_INPUT_REGISTERS 0x04
+#define MODBUS_FC_WRITE_SINGLE_COIL 0x05
+#define MODBUS_FC_WRITE_MULTIPLE_COILS 0x0F
+
+#define MODBUS_EX_ILLEGAL_FUNCTION 0x01
+#define MODBUS_EX_ILLEGAL_ADDRESS 0x02
+#define MODBUS_EX_ILLEGAL_VALUE 0x03
+
+#define MODBUS_IREG_WIFI_CONNECTED 0
+#define MODBUS_IREG_RSSI 1
+#define MODBUS_IREG_UPTIME_HI 2
+#define MODBUS_IREG_UPTIME_LO 3
+#define MODBUS_IREG_COUNT 4
+
+size_t modbus_exception(uint8_t fc, uint8_t code, uint8_t *resp) {
+    resp[0] = fc | 0x80;
+    resp[1] = code;
+    return 2;
+}
+
+uint16_t modbus_input_register(int reg) {
+    uint32_t uptime = millis() / 1000;
+    switch (reg) {
+        case MODBUS_IREG_WIFI_CONNECTED: return wifi_connected;
+        case MODBUS_IREG_RSSI: return (uint16_t)(int16_t)wifi_rssi;
+        case MODBUS_IREG_UPTIME_HI: return uptime >> 16;
+        case MODBUS_IREG_UPTIME_LO: return uptime & 0xFFFF;
+        default: return 0;
+    }
+}
+
+// Handles one request PDU, writes the response PDU and returns its length
+size_t modbus_process_pdu(const uint8_t *req, size_t len, uint8_t *resp) {
+    uint8_t fc = len ? req[0] : 0;
+    switch (fc) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            break;
+        default:
+            return modbus_exception(fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+    }
+    // Each supported function carries an address and a quantity or value;
+    // Write Multiple Coils checks its byte count and data below
+    if (len < 5) {
+        return modbus_exception(fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+    }
+    uint16_t addr = (req[1] << 8) | req[2];
+    uint16_t value = (req[3] << 8) | req[4];
+    
+    switch (fc) {
+        case MODBUS_FC_READ_COILS: {
+            if (value < 1 || value > 2000) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+            }
+            if (addr + value > 4) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+            }
+            resp[0] = fc;
+            resp[1] = 1;
+            resp[2] = 0;
+            for (int i = 0; i < value; i++) {
+                resp[2] |= relay_states[addr + i] << i;
+            }
+            return 3;
+        }
+        case MODBUS_FC_READ_INPUT_REGISTERS: {
+            if (value < 1 || value > 125) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+            }
+            if (addr + value > MODBUS_IREG_COUNT) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+            }
+            resp[0] = fc;
+            resp[1] = value * 2;
+            for (int i = 0; i < value; i++) {
+                uint16_t reg = modbus_input_register(addr + i);
+                resp[2 + i * 2] = reg >> 8;
+                resp[3 + i * 2] = reg & 0xFF;
+            }
+            return 2 + value * 2;
+        }
+        case MODBUS_FC_WRITE_SINGLE_COIL: {
+            if (value != 0xFF00 && value != 0x0000) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+            }
+            if (addr >= 4) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+            }
+            set_relay(addr, value == 0xFF00);
+            refresh_state_snapshot();
+            memcpy(resp, req, 5);
+            return 5;
+        }
+        case MODBUS_FC_WRITE_MULTIPLE_COILS: {
+            if (len < 6 || value < 1 || value > 0x7B0 || req[5] != (value + 7) / 8 || len < 6u + req[5]) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_VALUE, resp);
+            }
+            if (addr + value > 4) {
+                return modbus_exception(fc, MODBUS_EX_ILLEGAL_ADDRESS, resp);
+            }
+            // Everything is validated above, so the whole write applies or none
+            // of it, and set_relays() switches the coils together
+            uint8_t mask = 0;
+            uint8_t states[4] = {0, 0, 0, 0};
+            for (int i = 0; i < value; i++) {
+                mask |= 1 << (addr + i);
+                states[addr + i] = (req[6] >> i) & 1;
+            }
+            set_relays(mask, states);
+            refresh_state_snapshot();
+            memcpy(resp, req, 5);
+            return 5;
+        }
+        default:
+            return modbus_exception(fc, MODBUS_EX_ILLEGAL_FUNCTION, resp);
+    }
+}
+
+// Consumes complete MBAP frames from the client buffer; returns false on a bad frame
+bool modbus_process_frames(ModbusClient &mc) {
+    while (mc.len >= 7) {
+        uint16_t protocol = (mc.buf[2] << 8) | mc.buf[3];
+        uint16_t length = (mc.buf[4] << 8) | mc.buf[5];
+        if (protocol != 0 || length < 2 || length > MODBUS_FRAME_MAX - 6) {
+            return false;
+        }
+        size_t frame_len = 6 + length;
+        if (mc.len < frame_len) {
+            return true;
+        }
+        
+        uint8_t resp[MODBUS_FRAME_MAX];
+        size_t pdu_len = modbus_process_pdu(mc.buf + 7, length - 1, resp + 7);
+        memcpy(resp, mc.buf, 4);
+        resp[4] = (pdu_len + 1) >> 8;
+        resp[5] = (pdu_len + 1) & 0xFF;
+        resp[6] = mc.buf[6];
+        mc.client.write(resp, 7 + pdu_len);
+        
+        memmove(mc.buf, mc.buf + frame_len, mc.len - frame_len);
+        mc.len -= frame_len;
+    }
+    return true;
+}
+
+void service_modbus() {
+    WiFiClient incoming = modbus_server.available();
+    if (incoming) {
+        int slot = -1;
+        for (int i = 0; i < MODBUS_CLIENTS_MAX; i++) {
+            if (!modbus_clients[i].client.connected()) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot >= 0) {
+            incoming.setNoDelay(true);
+            modbus_clients[slot].client = incoming;
+            modbus_clients[slot].len = 0;
+            modbus_clients[slot].last_seen = millis();
+        } else {
+            Serial.println("[Modbus] Too many masters, rejecting connection");
+            incoming.stop();
+        }
+    }
+    
+    for (int i = 0; i < MODBUS_CLIENTS_MAX; i++) {
+        ModbusClient &mc = modbus_clients[i];
+        if (!mc.client.connected()) {
+            continue;
+        }
+        
+        int avail = mc.client.available();
+        if (avail > 0) {
+            size_t room = MODBUS_FRAME_MAX - mc.len;
+            int n = mc.client.read(mc.buf + mc.len, min((size_t)avail, room));
+            if (n > 0) {
+                mc.len += n;
+                mc.last_seen = millis();
+            }
+            if (!modbus_process_frames(mc)) {
+                Serial.println("[Modbus] Malformed frame, closing connection");
+                mc.client.stop();
+                continue;
             }
+        }
+        
+        if (millis() - mc.last_seen > MODBUS_IDLE_TIMEOUT_MS) {
+            mc.client.stop();
+        }
+    }
+}
 
-            if (file.size === 0) {
-                msg.className = 'message error';
-                msg.textContent = 'File is empty';
-                return;
-            }
+// Current sensing
+#if AIRBOX_CURRENT_SENSE
+// Called from loop() for every newly raised fault; override to forward alerts
+__attribute__((weak)) void on_current_alert(int relay, uint8_t faults) {
+    Serial.printf("[Current] Relay %d fault:%s%s%s%s\n", relay + 1,
+        (faults & CURRENT_FAULT_OVERCURRENT) ? " overcurrent" : "",
+        (faults & CURRENT_FAULT_NO_LOAD) ? " no-load" : "",
+        (faults & CURRENT_FAULT_INRUSH) ? " inrush" : "",
+        (faults & CURRENT_FAULT_STUCK_ON) ? " stuck-on" : "");
+}
 
-            msg.className = 'message';
-            msg.textContent = 'Uploading firmware... Please wait';
-
-            var formData = new FormData();
-            formData.append('firmware', file);
-
-            fetch('/firmware/upload', {
-                method: 'POST',
-                body: formData
-            })
-                .then(r => r.json())
-                .then(d => {
-                    if (d.success) {
-                        msg.className = 'message success';
-                        msg.textContent = 'Firmware uploaded successfully. Device is restarting...';
-                        fileInput.value = '';
-                    } else {
-                        msg.className = 'message error';
-                        msg.textContent = 'Error: ' + (d.message || 'Unknown error');
-                    }
-                })
-                .catch(e => {
-                    msg.className = 'message error';
-                    msg.textContent = 'Upload failed: ' + e;
-                });
+void setup_current_config() {
+    for (int i = 0; i < CURRENT_CHANNELS; i++) {
+        current_config[i].zero_offset = CURRENT_ZERO_OFFSET;
+        current_config[i].ma_per_count_q8 = CURRENT_MA_PER_COUNT_Q8;
+        current_config[i].overcurrent_ma = CURRENT_OVERCURRENT_MA;
+        current_config[i].no_load_ma = CURRENT_NO_LOAD_MA;
+        current_config[i].inrush_max_ms = CURRENT_INRUSH_MAX_MS;
+        current_config[i].off_settle_ms = CURRENT_OFF_SETTLE_MS;
+    }
+}
+
+// Drains the ADC DMA buffer and evaluates one window per CURRENT_WINDOW_SAMPLES;
+// all per-sample work stays in this task, off the loop() core
+void current_sense_task(void *arg) {
+    static uint8_t raw[CURRENT_DMA_READ_BYTES];
+    static CurrentSample samples[CURRENT_DMA_READ_BYTES / sizeof(adc_digi_output_data_t)];
+    CurrentAccumulator acc[CURRENT_CHANNELS] = {};
+    
+    for (;;) {
+        uint32_t got = 0;
+        esp_err_t err = adc_digi_read_bytes(raw, sizeof(raw), &got, 1000);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            continue;
         }
+        
+        size_t n = 0;
+        for (uint32_t i = 0; i + sizeof(adc_digi_output_data_t) <= got; i += sizeof(adc_digi_output_data_t)) {
+            const adc_digi_output_data_t *p = (const adc_digi_output_data_t *)&raw[i];
+            for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+                if (p->type1.channel == current_adc_channels[ch]) {
+                    samples[n].channel = ch;
+                    samples[n].value = p->type1.data;
+                    n++;
+                    break;
+                }
+            }
+        }
+        current_accumulate(acc, samples, n);
+        if (acc[0].count < CURRENT_WINDOW_SAMPLES) {
+            continue;
+        }
+        
+        CurrentReading readings[CURRENT_CHANNELS];
+        for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+            current_finish(acc[ch], current_config[ch], readings[ch]);
+        }
+        memset(acc, 0, sizeof(acc));
+        
+        uint32_t now = millis();
+        portENTER_CRITICAL(&current_mux);
+        for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+            current_readings[ch] = readings[ch];
+            current_raised[ch] |= current_evaluate(current_states[ch], current_config[ch], readings[ch],
+                relay_outputs[ch], now);
+        }
+        portEXIT_CRITICAL(&current_mux);
+    }
+}
 
-        // Initialize
-        updateWiFiStatus();
-        setInterval(updateWiFiStatus, 5000);
-    </script>
-</body>
-</html>
-)rawliteral";
+void setup_current_sense() {
+    setup_current_config();
+    
+    adc_digi_init_config_t init_config = {};
+    init_config.max_store_buf_size = 4 * CURRENT_DMA_READ_BYTES;
+    init_config.conv_num_each_intr = CURRENT_DMA_READ_BYTES;
+    adc_digi_pattern_config_t pattern[CURRENT_CHANNELS] = {};
+    for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+        init_config.adc1_chan_mask |= BIT(current_adc_channels[ch]);
+        pattern[ch].atten = ADC_ATTEN_DB_11;
+        pattern[ch].channel = current_adc_channels[ch];
+        pattern[ch].unit = 0;
+        pattern[ch].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+    }
+    
+    adc_digi_configuration_t dig_config = {};
+    dig_config.conv_limit_en = true;   // required on the ESP32
+    dig_config.conv_limit_num = 250;
+    dig_config.pattern_num = CURRENT_CHANNELS;
+    dig_config.adc_pattern = pattern;
+    dig_config.sample_freq_hz = CURRENT_SAMPLE_RATE_HZ;
+    dig_config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    dig_config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+    
+    if (adc_digi_initialize(&init_config) != ESP_OK ||
+        adc_digi_controller_configure(&dig_config) != ESP_OK ||
+        adc_digi_start() != ESP_OK) {
+        Serial.println("[Current] ADC DMA init failed");
+        return;
+    }
+    // Core 0, next to the WiFi stack; loop() runs on core 1
+    xTaskCreatePinnedToCore(current_sense_task, "current", 4096, NULL, 5, NULL, 0);
+}
 
-// CORS helpers
-void addCorsHeaders() {
-    server.sendHeader("Access-Control-Allow-Origin", "*");
-    server.sendHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-    server.sendHeader("Access-Control-Allow-Headers", "Content-Type");
+// Publishes fault changes: alert hook for new faults, /state for any change
+void service_current() {
+    uint8_t faults[CURRENT_CHANNELS];
+    uint8_t raised[CURRENT_CHANNELS];
+    portENTER_CRITICAL(&current_mux);
+    for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+        faults[ch] = current_states[ch].faults;
+        raised[ch] = current_raised[ch];
+        current_raised[ch] = 0;
+    }
+    portEXIT_CRITICAL(&current_mux);
+    
+    for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+        if (raised[ch]) {
+            on_current_alert(ch, raised[ch]);
+        }
+    }
+    if (memcmp(faults, relay_faults, sizeof(relay_faults)) != 0) {
+        memcpy(relay_faults, faults, sizeof(relay_faults));
+        refresh_state_snapshot();
+    }
 }
+#endif
 
-void handle_options() {
-    addCorsHeaders();
-    server.send(204);
+// Fleet OTA
+// A box that received an image with /firmware/upload?fleet=1 (or pulled one)
+// announces it by UDP broadcast and serves it in chunks over HTTP. Boxes
+// running another build of the same project pull the chunks straight into
+// their OTA partition, verify the hash, start announcing themselves and
+// restart in a staggered slot once nobody is pulling from them.
+void to_hex(const uint8_t *data, size_t len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0x0F];
+    }
+    out[len * 2] = '\0';
 }
 
-void register_options(const char* path) {
-    server.on(path, HTTP_OPTIONS, handle_options);
+const char *fleet_running_version() {
+    return fleet_version_tag + strlen(FLEET_VERSION_TAG);
 }
 
+// Compares dotted numeric versions, "1.10" > "1.9" and "1.2" == "1.2.0";
+// anything after the numbers (e.g. "-rc1") is ignored
+int fleet_compare_versions(const char *a, const char *b) {
+    for (;;) {
+        char *end_a;
+        char *end_b;
+        unsigned long x = strtoul(a, &end_a, 10);
+        unsigned long y = strtoul(b, &end_b, 10);
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+        if (*end_a != '.' && *end_b != '.') {
+            return 0;
+        }
+        a = *end_a == '.' ? end_a + 1 : end_a;
+        b = *end_b == '.' ? end_b + 1 : end_b;
+    }
+}
 
+void fleet_scan_version(FleetVersionScan &scan, const uint8_t *data, size_t n) {
+    static const char tag[] = FLEET_VERSION_TAG;
+    for (size_t i = 0; i < n && !scan.found; i++) {
+        char c = (char)data[i];
+        if (scan.in_version) {
+            if (c == '\0' && scan.len > 0) {
+                scan.version[scan.len] = '\0';
+                scan.found = true;
+            } else if (c >= '!' && c <= '~' && scan.len < sizeof(scan.version) - 1) {
+                scan.version[scan.len++] = c;
+            } else {
+                // Not a version string, e.g. the search tag itself
+                scan.in_version = false;
+                scan.matched = 0;
+            }
+        } else if (c == tag[scan.matched]) {
+            if (++scan.matched == sizeof(tag) - 1) {
+                scan.in_version = true;
+                scan.len = 0;
+            }
+        } else {
+            scan.matched = c == tag[0] ? 1 : 0;
+        }
+    }
+}
 
-void handle_root() {
-    addCorsHeaders();
-    server.send(200, "text/html", html_page);
+unsigned long fleet_restart_slot_delay() {
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    return FLEET_RESTART_MIN_MS + (unsigned long)((mac[4] ^ mac[5]) % FLEET_RESTART_SLOTS) * FLEET_RESTART_STAGGER_MS;
 }
 
-void handle_state() {
-    addCorsHeaders();
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddNumberToObject(root, "in1", relay_states[0]);
-    cJSON_AddNumberToObject(root, "in2", relay_states[1]);
-    cJSON_AddNumberToObject(root, "in3", relay_states[2]);
-    cJSON_AddNumberToObject(root, "in4", relay_states[3]);
+// Verifies the image just written to the boot partition and starts sharing it
+bool fleet_share_image(uint32_t size) {
+    const esp_partition_t *part = esp_ota_get_boot_partition();
+    esp_app_desc_t desc;
+    if (!part || part == esp_ota_get_running_partition() || size == 0 ||
+        esp_ota_get_partition_description(part, &desc) != ESP_OK) {
+        return false;
+    }
     
-    char *json_str = cJSON_Print(root);
-    server.send(200, "application/json", json_str);
+    // Hash what actually landed in flash, since that is what peers will get,
+    // and find the version tag on the way
+    uint8_t buf[1024];
+    uint8_t hash[32];
+    FleetVersionScan scan = {};
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    for (uint32_t offset = 0; offset < size; offset += sizeof(buf)) {
+        size_t n = min((uint32_t)sizeof(buf), size - offset);
+        if (esp_partition_read(part, offset, buf, n) != ESP_OK) {
+            mbedtls_sha256_free(&sha);
+            return false;
+        }
+        mbedtls_sha256_update(&sha, buf, n);
+        fleet_scan_version(scan, buf, n);
+    }
+    mbedtls_sha256_finish(&sha, hash);
+    mbedtls_sha256_free(&sha);
+    if (!scan.found) {
+        Serial.println("[Fleet] Image has no AirBox version tag, not sharing");
+        return false;
+    }
     
-    free(json_str);
-    cJSON_Delete(root);
+    strcpy(fleet_image.version, scan.version);
+    to_hex(desc.app_elf_sha256, sizeof(desc.app_elf_sha256), fleet_image.app);
+    to_hex(hash, sizeof(hash), fleet_image.sha256);
+    fleet_image.size = size;
+    fleet_partition = part;
+    fleet_ready_at = millis();
+    fleet_last_served = fleet_ready_at;
+    fleet_restart_delay = fleet_restart_slot_delay();
+    fleet_state = FLEET_SHARING;
+    
+    Serial.printf("[Fleet] Sharing %s (%u bytes), restart in %lu ms or later\n",
+        fleet_image.version, (unsigned)size, fleet_restart_delay);
+    return true;
 }
 
-void handle_relay_multi() {
-    addCorsHeaders();
-    if (server.hasArg("relay") && server.hasArg("state")) {
-        String relayStr = server.arg("relay");
-        String stateStr = server.arg("state");
-        
-        char relayBuf[50], stateBuf[50];
-        strncpy(relayBuf, relayStr.c_str(), sizeof(relayBuf) - 1);
-        strncpy(stateBuf, stateStr.c_str(), sizeof(stateBuf) - 1);
-        
-        int relayCount = 0;
-        char *token = strtok(relayBuf, ",");
-        while (token && relayCount < 4) {
-            int idx = atoi(token);
-            token = strtok(NULL, ",");
-            
-            token = strtok(stateBuf, ",");
-            if (token && idx >= 0 && idx <= 3) {
-                int state = atoi(token);
-                relay_states[idx] = state ? 1 : 0;
-                digitalWrite(relay_pins[idx], !relay_states[idx]);
+bool fleet_fetch_chunk(uint32_t source, uint32_t offset, uint32_t len, uint8_t *buf) {
+    char url[96];
+    snprintf(url, sizeof(url), "http://%s/fleet/image?offset=%u&length=%u",
+        IPAddress(source).toString().c_str(), (unsigned)offset, (unsigned)len);
+    
+    HTTPClient http;
+    http.setTimeout(FLEET_HTTP_TIMEOUT_MS);
+    if (!http.begin(url)) {
+        return false;
+    }
+    
+    uint32_t got = 0;
+    if (http.GET() == 200 && http.getSize() == (int)len) {
+        WiFiClient *stream = http.getStreamPtr();
+        unsigned long start = millis();
+        while (got < len && millis() - start < FLEET_HTTP_TIMEOUT_MS) {
+            int n = stream->read(buf + got, len - got);
+            if (n > 0) {
+                got += n;
+            } else {
+                delay(1);
             }
-            relayCount++;
-            strcpy(stateBuf, "");
         }
-        
-        cJSON *root = cJSON_CreateObject();
-        cJSON_AddNumberToObject(root, "in1", relay_states[0]);
-        cJSON_AddNumberToObject(root, "in2", relay_states[1]);
-        cJSON_AddNumberToObject(root, "in3", relay_states[2]);
-        cJSON_AddNumberToObject(root, "in4", relay_states[3]);
-        
-        char *json_str = cJSON_Print(root);
-        server.send(200, "application/json", json_str);
-        free(json_str);
-        cJSON_Delete(root);
-        return;
     }
-    server.send(400, "application/json", "{\"error\":\"Invalid parameters\"}");
+    http.end();
+    return got == len;
 }
 
-void handle_wifi_status() {
-    addCorsHeaders();
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddNumberToObject(root, "connected", wifi_connected);
-    cJSON_AddStringToObject(root, "ssid", wifi_ssid_current.c_str());
-    cJSON_AddStringToObject(root, "ip", wifi_ip_current.c_str());
-    cJSON_AddNumberToObject(root, "rssi", wifi_rssi);
+// Pulls fleet_image chunk by chunk from a random known source
+void fleet_pull_task(void *arg) {
+    static uint8_t chunk[FLEET_CHUNK];
+    FleetVersionScan scan = {};
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
     
-    char *json_str = cJSON_Print(root);
-    server.send(200, "application/json", json_str);
+    bool ok = Update.begin(fleet_image.size);
+    int failures = 0;
+    while (ok && fleet_progress < fleet_image.size) {
+        uint32_t len = min((uint32_t)FLEET_CHUNK, fleet_image.size - fleet_progress);
+        portENTER_CRITICAL(&fleet_mux);
+        uint32_t source = fleet_sources[(uint32_t)esp_random() % fleet_source_count];
+        portEXIT_CRITICAL(&fleet_mux);
+        
+        if (fleet_fetch_chunk(source, fleet_progress, len, chunk) && Update.write(chunk, len) == len) {
+            mbedtls_sha256_update(&sha, chunk, len);
+            fleet_scan_version(scan, chunk, len);
+            fleet_progress += len;
+            failures = 0;
+        } else if (++failures > FLEET_RETRIES_MAX) {
+            ok = false;
+        } else {
+            delay(200);
+        }
+    }
     
-    free(json_str);
-    cJSON_Delete(root);
+    uint8_t hash[32];
+    char hex[65];
+    mbedtls_sha256_finish(&sha, hash);
+    mbedtls_sha256_free(&sha);
+    to_hex(hash, sizeof(hash), hex);
+    if (ok && strcmp(hex, fleet_image.sha256) != 0) {
+        Serial.println("[Fleet] Image hash mismatch");
+        ok = false;
+    }
+    if (ok && (!scan.found || strcmp(scan.version, fleet_image.version) != 0)) {
+        Serial.println("[Fleet] Image version does not match the announcement");
+        ok = false;
+    }
+    
+    if (ok) {
+        ok = Update.end(true);
+    } else if (Update.isRunning()) {
+        Update.abort();
+    }
+    
+    if (ok && !fleet_share_image(fleet_image.size)) {
+        // Already set as boot partition; just do not hold it for peers
+        Serial.println("[Fleet] Update written but cannot be shared, restarting");
+        delay(1000);
+        ESP.restart();
+    }
+    if (!ok) {
+        Update.printError(Serial);
+        Serial.println("[Fleet] Pull failed");
+        fleet_failed_at = millis();
+        fleet_state = FLEET_FAILED;
+    }
+    vTaskDelete(NULL);
 }
 
-void handle_relay_set() {
-    addCorsHeaders();
-    if (server.hasArg("plain")) {
-        String body = server.arg("plain");
-        cJSON *root = cJSON_Parse(body.c_str());
-        
-        if (root) {
-            cJSON *relay_item = cJSON_GetObjectItem(root, "relay");
-            cJSON *state_item = cJSON_GetObjectItem(root, "state");
-            
-            if (relay_item && state_item) {
-                int relay = relay_item->valueint;
-                uint8_t state = state_item->valueint ? 1 : 0;
-                
-                if (relay >= 0 && relay <= 3) {
-                    relay_states[relay] = state;
-                    digitalWrite(relay_pins[relay], !state);
-                    
-                    cJSON *response = cJSON_CreateObject();
-                    cJSON_AddNumberToObject(response, "success", 1);
-                    char *json_str = cJSON_Print(response);
-                    server.send(200, "application/json", json_str);
-                    free(json_str);
-                    cJSON_Delete(response);
-                    cJSON_Delete(root);
-                    return;
-                }
+void fleet_on_announce(uint32_t source, const FleetImage &image) {
+    if (fleet_state == FLEET_PULLING || fleet_state == FLEET_SHARING) {
+        if (fleet_state == FLEET_PULLING && strcmp(image.sha256, fleet_image.sha256) == 0) {
+            portENTER_CRITICAL(&fleet_mux);
+            bool known = false;
+            for (int i = 0; i < fleet_source_count; i++) {
+                known = known || fleet_sources[i] == source;
             }
-            cJSON_Delete(root);
+            if (!known && fleet_source_count < FLEET_SOURCES_MAX) {
+                fleet_sources[fleet_source_count++] = source;
+            }
+            portEXIT_CRITICAL(&fleet_mux);
         }
+        return;
+    }
+    if (fleet_state == FLEET_FAILED && millis() - fleet_failed_at < FLEET_RETRY_MS) {
+        return;
+    }
+    // Both this and the upload handler run on loop(), so this check cannot race
+    if (firmware_upload_active || Update.isRunning()) {
+        return;
+    }
+    
+    // Only ever move forward, so an old build on one box cannot downgrade the
+    // others and two images in flight cannot send boxes back and forth
+    const esp_app_desc_t *own = esp_ota_get_app_description();
+    char own_app[65];
+    to_hex(own->app_elf_sha256, sizeof(own->app_elf_sha256), own_app);
+    if (fleet_compare_versions(image.version, fleet_running_version()) <= 0 ||
+        strcmp(image.app, own_app) == 0) {
+        return;
+    }
+    
+    Serial.printf("[Fleet] %s -> %s announced by %s, pulling %u bytes\n", fleet_running_version(),
+        image.version, IPAddress(source).toString().c_str(), (unsigned)image.size);
+    fleet_image = image;
+    fleet_sources[0] = source;
+    fleet_source_count = 1;
+    fleet_progress = 0;
+    fleet_state = FLEET_PULLING;
+    if (xTaskCreatePinnedToCore(fleet_pull_task, "fleet", 8192, NULL, 1, NULL, 0) != pdPASS) {
+        fleet_failed_at = millis();
+        fleet_state = FLEET_FAILED;
     }
-    server.send(400, "application/json", "{\"success\":0}");
 }
 
-void handle_wifi_config() {
-    addCorsHeaders();
-    if (server.hasArg("plain")) {
-        String body = server.arg("plain");
-        cJSON *root = cJSON_Parse(body.c_str());
-        
-        if (root) {
-            cJSON *ssid_item = cJSON_GetObjectItem(root, "ssid");
-            cJSON *password_item = cJSON_GetObjectItem(root, "password");
-            
-            if (ssid_item && password_item && ssid_item->valuestring && password_item->valuestring) {
-                preferences.begin("wifi", false);
-                preferences.putString("ssid", ssid_item->valuestring);
-                preferences.putString("password", password_item->valuestring);
-                preferences.end();
-                
-                cJSON *response = cJSON_CreateObject();
-                cJSON_AddNumberToObject(response, "success", 1);
-                char *json_str = cJSON_Print(response);
-                server.send(200, "application/json", json_str);
-                free(json_str);
-                cJSON_Delete(response);
-                cJSON_Delete(root);
-                
-                delay(2000);
-                ESP.restart();
-                return;
-            }
-            cJSON_Delete(root);
-        }
+bool fleet_copy_string(cJSON *root, const char *key, char *out, size_t cap) {
+    cJSON *item = cJSON_GetObjectItem(root, key);
+    if (!cJSON_IsString(item) || strlen(item->valuestring) >= cap) {
+        return false;
     }
-    server.send(400, "application/json", "{\"success\":0}");
+    strcpy(out, item->valuestring);
+    return true;
 }
 
-void handle_wifi_reset() {
-    addCorsHeaders();
-    preferences.begin("wifi", false);
-    preferences.clear();
-    preferences.end();
+void fleet_receive() {
+    if (fleet_udp.parsePacket() <= 0) {
+        return;
+    }
+    char buf[384];
+    int n = fleet_udp.read((uint8_t *)buf, sizeof(buf) - 1);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
     
-    cJSON *response = cJSON_CreateObject();
-    cJSON_AddNumberToObject(response, "success", 1);
-    char *json_str = cJSON_Print(response);
-    server.send(200, "application/json", json_str);
+    cJSON *root = cJSON_Parse(buf);
+    if (!root) {
+        return;
+    }
+    FleetImage image;
+    cJSON *magic = cJSON_GetObjectItem(root, "airbox_fleet");
+    cJSON *size = cJSON_GetObjectItem(root, "size");
+    if (cJSON_IsNumber(magic) && magic->valueint == 1 && cJSON_IsNumber(size) && size->valuedouble > 0 &&
+        fleet_copy_string(root, "version", image.version, sizeof(image.version)) &&
+        fleet_copy_string(root, "app", image.app, sizeof(image.app)) &&
+        fleet_copy_string(root, "sha256", image.sha256, sizeof(image.sha256))) {
+        image.size = (uint32_t)size->valuedouble;
+        fleet_on_announce(fleet_udp.remoteIP(), image);
+    }
+    cJSON_Delete(root);
+}
+
+void fleet_announce() {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "airbox_fleet", 1);
+    cJSON_AddStringToObject(root, "version", fleet_image.version);
+    cJSON_AddStringToObject(root, "app", fleet_image.app);
+    cJSON_AddStringToObject(root, "sha256", fleet_image.sha256);
+    cJSON_AddNumberToObject(root, "size", fleet_image.size);
+    char *json_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (!json_str) {
+        return;
+    }
+    fleet_udp.beginPacket(IPAddress(255, 255, 255, 255), FLEET_PORT);
+    fleet_udp.write((const uint8_t *)json_str, strlen(json_str));
+    fleet_udp.endPacket();
     free(json_str);
-    cJSON_Delete(response);
+}
+
+void service_fleet() {
+#if AIRBOX_FLEET_PULL
+    fleet_receive();
+#endif
+    if (fleet_state != FLEET_SHARING) {
+        return;
+    }
     
-    delay(2000);
-    ESP.restart();
+    unsigned long now = millis();
+    if (now - fleet_last_announce >= FLEET_ANNOUNCE_MS) {
+        fleet_last_announce = now;
+        fleet_announce();
+    }
+    if (now - fleet_ready_at >= fleet_restart_delay && now - fleet_last_served >= FLEET_SERVE_IDLE_MS) {
+        Serial.println("[Fleet] Restarting into new firmware");
+        delay(100);
+        ESP.restart();
+    }
 }
 
-void handle_firmware_upload() {
+void handle_fleet_status() {
+    if (!admit_request(RATE_READ)) {
+        return;
+    }
+    
+    addCorsHeaders();
+    FleetState state = fleet_state;
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "state", fleet_state_names[state]);
+    cJSON_AddStringToObject(root, "running", fleet_running_version());
+    cJSON_AddNumberToObject(root, "pull", AIRBOX_FLEET_PULL);
+    if (state != FLEET_IDLE) {
+        cJSON_AddStringToObject(root, "version", fleet_image.version);
+        cJSON_AddNumberToObject(root, "size", fleet_image.size);
+        cJSON_AddNumberToObject(root, "progress", state == FLEET_SHARING ? fleet_image.size : fleet_progress);
+        cJSON_AddNumberToObject(root, "sources", fleet_source_count);
+    }
+    if (state == FLEET_SHARING) {
+        unsigned long elapsed = millis() - fleet_ready_at;
+        cJSON_AddNumberToObject(root, "restart_in_ms", elapsed < fleet_restart_delay ? fleet_restart_delay - elapsed : 0);
+    }
+    send_reply(200, root);
+}
+
+// Not rate limited: peers fetch chunks back to back
+void handle_fleet_image() {
     addCorsHeaders();
+    if (fleet_state != FLEET_SHARING) {
+        cJSON *response = cJSON_CreateObject();
+        cJSON_AddStringToObject(response, "error", "No image to share");
+        send_reply(404, response);
+        return;
+    }
     
-    HTTPUpload& upload = server.upload();
+    uint32_t offset = strtoul(server.arg("offset").c_str(), NULL, 10);
+    uint32_t len = strtoul(server.arg("length").c_str(), NULL, 10);
+    if (len == 0 || len > FLEET_CHUNK_MAX || offset >= fleet_image.size || len > fleet_image.size - offset) {
+        cJSON *response = cJSON_CreateObject();
+        cJSON_AddStringToObject(response, "error", "Invalid range");
+        send_reply(400, response);
+        return;
+    }
     
-    if (upload.status == UPLOAD_FILE_START) {
-        Serial.printf("[OTA] Update start: %s\n", upload.filename.c_str());
-        if (!Update.begin(UPDATE_SIZE_UNKNOWN)) {
-            Update.printError(Serial);
-        }
-    } else if (upload.status == UPLOAD_FILE_WRITE) {
-        if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
-            Update.printError(Serial);
-        }
-    } else if (upload.status == UPLOAD_FILE_END) {
-        if (Update.end(true)) {
-            Serial.println("[OTA] Update complete!");
-            cJSON *response = cJSON_CreateObject();
-            cJSON_AddNumberToObject(response, "success", 1);
-            cJSON_AddStringToObject(response, "message", "Firmware updated successfully");
-            char *json_str = cJSON_Print(response);
-            server.send(200, "application/json", json_str);
-            free(json_str);
-            cJSON_Delete(response);
-            
-            delay(2000);
-            ESP.restart();
-        } else {
-            Serial.println("[OTA] Update failed!");
-            cJSON *response = cJSON_CreateObject();
-            cJSON_AddNumberToObject(response, "success", 0);
-            cJSON_AddStringToObject(response, "message", "Firmware update failed");
-            char *json_str = cJSON_Print(response);
-            server.send(500, "application/json", json_str);
-            free(json_str);
-            cJSON_Delete(response);
+    fleet_last_served = millis();
+    server.setContentLength(len);
+    server.send(200, "application/octet-stream", "");
+    uint8_t buf[1024];
+    for (uint32_t done = 0; done < len; ) {
+        size_t n = min((uint32_t)sizeof(buf), len - done);
+        if (esp_partition_read(fleet_partition, offset + done, buf, n) != ESP_OK) {
+            break;
         }
-    } else if (upload.status == UPLOAD_FILE_ABORTED) {
-        Update.printError(Serial);
-        server.send(400, "application/json", "{\"success\":0,\"message\":\"Upload aborted\"}");
+        server.sendContent((const char *)buf, n);
+        done += n;
     }
+    fleet_last_served = millis();
 }
 
 void wifi_event_handler(WiFiEvent_t event) {
@@ -745,29 +2026,45 @@ void wifi_event_handler(WiFiEvent_t event) {
 void setup_wifi_sta(String ssid, String password);
 void setup_wifi_ap();
 
+// Polls a pending STA connection; falls back to AP mode after the timeout
+void service_wifi_sta() {
+    if (!wifi_sta_pending) {
+        return;
+    }
+    if (WiFi.status() == WL_CONNECTED) {
+        wifi_sta_pending = false;
+        wifi_connected = 1;
+        wifi_ip_current = WiFi.localIP().toString();
+        boot_mark("wifi_connected");
+        Serial.println("[WiFi] Successfully connected!");
+        Serial.print("[WiFi] IP address: ");
+        Serial.println(wifi_ip_current);
+        Serial.print("[WiFi] Signal strength: ");
+        Serial.print(WiFi.RSSI());
+        Serial.println(" dBm");
+    } else if (millis() - wifi_sta_started >= WIFI_CONNECT_TIMEOUT_MS) {
+        wifi_sta_pending = false;
+        Serial.println("[WiFi] Connection timeout - switching to AP mode");
+        setup_wifi_ap();
+    }
+}
+
 void setup_wifi_sta(String ssid, String password) {
     Serial.print("[WiFi] Connecting to: ");
     Serial.println(ssid);
     WiFi.mode(WIFI_STA);
     WiFi.begin(ssid.c_str(), password.c_str());
     wifi_ssid_current = ssid;
+    wifi_sta_pending = true;
+    wifi_sta_started = millis();
     
-    for (int i = 0; i < 20; i++) {
-        if (WiFi.status() == WL_CONNECTED) {
-            wifi_connected = 1;
-            wifi_ip_current = WiFi.localIP().toString();
-            Serial.println("[WiFi] Successfully connected!");
-            Serial.print("[WiFi] IP address: ");
-            Serial.println(wifi_ip_current);
-            Serial.print("[WiFi] Signal strength: ");
-            Serial.print(WiFi.RSSI());
-            Serial.println(" dBm");
-            return;
-        }
+#if !AIRBOX_FAST_BOOT
+    service_wifi_sta();
+    while (wifi_sta_pending) {
         delay(500);
+        service_wifi_sta();
     }
-    Serial.println("[WiFi] Connection timeout - switching to AP mode");
-    setup_wifi_ap();
+#endif
 }
 
 void setup_wifi_ap() {
@@ -776,25 +2073,47 @@ void setup_wifi_ap() {
     WiFi.softAP(WIFI_SSID, WIFI_PASSWORD);
     wifi_ssid_current = WIFI_SSID;
     wifi_ip_current = "192.168.4.1";
+    boot_mark("wifi_ap");
     Serial.print("[WiFi] AP SSID: ");
     Serial.println(WIFI_SSID);
     Serial.print("[WiFi] AP IP: ");
     Serial.println(wifi_ip_current);
 }
 
-void setup() {
-    Serial.begin(115200);
-    delay(1000);
-    Serial.println("\n[AirBox] Starting...");
-    
+void setup_relay_pins() {
     for (int i = 0; i < 4; i++) {
         pinMode(relay_pins[i], OUTPUT);
         digitalWrite(relay_pins[i], HIGH);
     }
-    
+    boot_mark("gpio");
+}
+
+void mount_spiffs() {
+    spiffs_pending = false;
     if (!SPIFFS.begin(true)) {
         Serial.println("SPIFFS Mount Failed");
     }
+    boot_mark("spiffs");
+}
+
+void setup() {
+    boot_measure_app_start();
+    boot_mark("setup");
+#if AIRBOX_FAST_BOOT
+    setup_relay_pins();
+    Serial.begin(115200);
+#else
+    Serial.begin(115200);
+    delay(1000);
+#endif
+    boot_mark("serial");
+    Serial.printf("\n[AirBox] Starting firmware %s...\n", fleet_running_version());
+    boot_log_flush();
+    
+#if !AIRBOX_FAST_BOOT
+    setup_relay_pins();
+    mount_spiffs();
+#endif
     
     // Load relay names from preferences removed - keeping API but no storage
     
@@ -811,13 +2130,21 @@ void setup() {
         setup_wifi_ap();
     }
     
+    state_boot_id = esp_random();
+    refresh_state_snapshot();
+    server.collectHeaders(collected_headers, sizeof(collected_headers) / sizeof(collected_headers[0]));
+    
     server.on("/", handle_root);
     server.on("/state", handle_state);
     server.on("/relay/multi", handle_relay_multi);
     server.on("/wifi/status", handle_wifi_status);
-    server.on("/relay/set", HTTP_POST, handle_relay_set);
-    server.on("/wifi/config", HTTP_POST, handle_wifi_config);
+    server.on("/relay/set", HTTP_POST, handle_relay_set, handle_request_body);
+    server.on("/wifi/config", HTTP_POST, handle_wifi_config, handle_request_body);
     server.on("/wifi/reset", HTTP_POST, handle_wifi_reset);
+    server.on("/current", handle_current);
+    server.on("/boot", handle_boot);
+    server.on("/fleet/status", handle_fleet_status);
+    server.on("/fleet/image", handle_fleet_image);
     server.on("/firmware/upload", HTTP_POST, handle_firmware_upload, handle_firmware_upload);
 
     register_options("/");
@@ -827,13 +2154,45 @@ void setup() {
     register_options("/relay/set");
     register_options("/wifi/config");
     register_options("/wifi/reset");
+    register_options("/current");
+    register_options("/boot");
+    register_options("/fleet/status");
+    register_options("/fleet/image");
     register_options("/firmware/upload");
     
     server.begin();
+    boot_mark("http");
+    modbus_server.setNoDelay(true);
+    modbus_server.begin();
+    boot_mark("modbus");
+#if AIRBOX_FLEET_PULL
+    // Announcing alone needs no bound port; beginPacket() opens the socket
+    fleet_udp.begin(FLEET_PORT);
+#endif
+    
+#if AIRBOX_CURRENT_SENSE
+    setup_current_sense();
+    boot_mark("current");
+#endif
 }
 
 void loop() {
-    server.handleClient();
+    for (int i = 0; i < HTTP_REQUESTS_PER_LOOP; i++) {
+        server.handleClient();
+    }
+    service_relays();
+    service_state_waiters();
+    service_modbus();
+    service_wifi_sta();
+    service_fleet();
+#if AIRBOX_CURRENT_SENSE
+    service_current();
+#endif
+    
+    // Non-critical init waits until WiFi has settled
+    if (spiffs_pending && !wifi_sta_pending) {
+        mount_spiffs();
+    }
     
     if (WiFi.status() == WL_CONNECTED) {
         wifi_rssi = WiFi.RSSI();
@@ -0,0 +1,254 @@
+// Host test for src/current_sense.h: feeds sample buffers shaped like the ADC
+// task's (four interleaved channels, drained in DMA-sized chunks) through the
+// same accumulate / finish / evaluate code and checks readings and faults.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "current_sense.h"
+
+// Same calibration and timing as the firmware defaults in src/main.cpp
+#define SAMPLE_RATE_HZ 20000
+#define WINDOW_SAMPLES 500
+#define WINDOW_MS (WINDOW_SAMPLES * CURRENT_CHANNELS * 1000 / SAMPLE_RATE_HZ)
+#define DMA_CHUNK 64
+#define MAINS_HZ 50.0
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);             \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+static CurrentChannelConfig test_config() {
+    CurrentChannelConfig cfg;
+    cfg.zero_offset = 2048;
+    cfg.ma_per_count_q8 = 2063;
+    cfg.overcurrent_ma = 8000;
+    cfg.no_load_ma = 150;
+    cfg.inrush_max_ms = 500;
+    cfg.off_settle_ms = 200;
+    return cfg;
+}
+
+// Sensor current in mA for one channel at time t; a plain sine plus DC
+struct Signal {
+    double rms_ma;
+    double dc_ma;
+    double off_at_ms;   // current drops to zero from here on (negative: never)
+};
+
+static uint16_t to_counts(double ma, const CurrentChannelConfig &cfg) {
+    double counts = cfg.zero_offset + ma * 256.0 / cfg.ma_per_count_q8;
+    if (counts < 0) {
+        counts = 0;
+    }
+    if (counts > 4095) {
+        counts = 4095;
+    }
+    return (uint16_t)lround(counts);
+}
+
+// One window of interleaved samples starting at start_ms, run through the
+// accumulator in DMA-sized chunks the way current_sense_task() does
+static void sample_window(const Signal sig[CURRENT_CHANNELS], double start_ms,
+                          const CurrentChannelConfig &cfg, CurrentReading out[CURRENT_CHANNELS]) {
+    std::vector<CurrentSample> buf;
+    for (int i = 0; i < WINDOW_SAMPLES; i++) {
+        for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+            double t_ms = start_ms + (i * CURRENT_CHANNELS + ch) * 1000.0 / SAMPLE_RATE_HZ;
+            double ma = 0;
+            if (sig[ch].off_at_ms < 0 || t_ms < sig[ch].off_at_ms) {
+                ma = sig[ch].dc_ma + sig[ch].rms_ma * sqrt(2.0) * sin(2 * M_PI * MAINS_HZ * t_ms / 1000.0);
+            }
+            CurrentSample s;
+            s.channel = (uint8_t)ch;
+            s.value = to_counts(ma, cfg);
+            buf.push_back(s);
+        }
+    }
+
+    CurrentAccumulator acc[CURRENT_CHANNELS] = {};
+    for (size_t i = 0; i < buf.size(); i += DMA_CHUNK) {
+        size_t n = buf.size() - i < DMA_CHUNK ? buf.size() - i : DMA_CHUNK;
+        current_accumulate(acc, &buf[i], n);
+    }
+    for (int ch = 0; ch < CURRENT_CHANNELS; ch++) {
+        current_finish(acc[ch], cfg, out[ch]);
+    }
+}
+
+static CurrentReading reading_of(double rms_ma, double dc_ma, double start_ms = 0, double off_at_ms = -1) {
+    CurrentChannelConfig cfg = test_config();
+    Signal sig[CURRENT_CHANNELS] = {};
+    sig[0].rms_ma = rms_ma;
+    sig[0].dc_ma = dc_ma;
+    sig[0].off_at_ms = off_at_ms;
+    for (int ch = 1; ch < CURRENT_CHANNELS; ch++) {
+        sig[ch].off_at_ms = -1;
+    }
+    CurrentReading out[CURRENT_CHANNELS];
+    sample_window(sig, start_ms, cfg, out);
+    return out[0];
+}
+
+static bool within(double value, double expected, double tolerance) {
+    return fabs(value - expected) <= tolerance;
+}
+
+static void test_isqrt() {
+    CHECK(current_isqrt(0) == 0);
+    CHECK(current_isqrt(1) == 1);
+    CHECK(current_isqrt(15) == 3);
+    CHECK(current_isqrt(16) == 4);
+    CHECK(current_isqrt(4294967296ULL) == 65536);
+    CHECK(current_isqrt(0xFFFFFFFFFFFFFFFFULL) == 0xFFFFFFFFu);
+}
+
+static void test_readings() {
+    CurrentReading r = reading_of(2000, 0);
+    CHECK(r.samples == WINDOW_SAMPLES);
+    CHECK(within(r.rms_ma, 2000, 40));
+    CHECK(within(r.avg_ma, 0, 10));
+
+    r = reading_of(5000, 0);
+    CHECK(within(r.rms_ma, 5000, 100));
+
+    // RMS includes the DC component: sqrt(1500^2 + 300^2)
+    r = reading_of(1500, 300);
+    CHECK(within(r.avg_ma, 300, 10));
+    CHECK(within(r.rms_ma, 1530, 40));
+
+    r = reading_of(0, -400);
+    CHECK(within(r.avg_ma, -400, 10));
+    CHECK(within(r.rms_ma, 400, 10));
+
+    // No load: only quantisation noise around the zero offset
+    r = reading_of(0, 0);
+    CHECK(r.rms_ma < 10);
+    CHECK(r.avg_ma == 0);
+
+    // Empty accumulator
+    CurrentAccumulator empty = {};
+    CurrentChannelConfig cfg = test_config();
+    current_finish(empty, cfg, r);
+    CHECK(r.samples == 0 && r.rms_ma == 0 && r.avg_ma == 0);
+
+    // Samples for unknown channels are ignored
+    CurrentAccumulator acc[CURRENT_CHANNELS] = {};
+    CurrentSample stray = {CURRENT_CHANNELS, 4095};
+    current_accumulate(acc, &stray, 1);
+    CHECK(acc[0].count == 0 && acc[CURRENT_CHANNELS - 1].count == 0);
+}
+
+// Evaluates a steady reading every window from `from` up to `to` (exclusive)
+// and returns the union of raised flags
+static uint8_t run(CurrentChannelState &st, double rms_ma, bool relay_on, uint32_t from, uint32_t to) {
+    CurrentChannelConfig cfg = test_config();
+    CurrentReading r = reading_of(rms_ma, 0);
+    uint8_t raised = 0;
+    for (uint32_t now = from; now < to; now += WINDOW_MS) {
+        raised |= current_evaluate(st, cfg, r, relay_on, now);
+    }
+    return raised;
+}
+
+static void test_normal_load() {
+    CurrentChannelState st = {};
+    CHECK(run(st, 0, false, 1000, 2000) == 0);
+    CHECK(run(st, 2000, true, 2000, 5000) == 0);
+    CHECK(st.faults == 0);
+}
+
+static void test_overcurrent() {
+    CurrentChannelState st = {};
+    run(st, 0, false, 1000, 1100);
+    CHECK(run(st, 2000, true, 1100, 2000) == 0);
+    CHECK(run(st, 9000, true, 2000, 2300) == CURRENT_FAULT_OVERCURRENT);
+    // Raised once, then only held
+    CHECK(run(st, 9000, true, 2300, 2600) == 0);
+    CHECK(st.faults == CURRENT_FAULT_OVERCURRENT);
+    CHECK(run(st, 2000, true, 2600, 2800) == 0);
+    CHECK(st.faults == 0);
+}
+
+static void test_inrush() {
+    // Short surge at switch-on is tolerated
+    CurrentChannelState st = {};
+    run(st, 0, false, 1000, 1100);
+    CHECK(run(st, 12000, true, 1100, 1400) == 0);
+    CHECK(run(st, 2000, true, 1400, 2000) == 0);
+    CHECK(st.faults == 0);
+
+    // A surge that outlasts inrush_max_ms is reported as inrush, not overcurrent
+    st = CurrentChannelState();
+    run(st, 0, false, 1000, 1100);
+    CHECK(run(st, 12000, true, 1100, 1600) == 0);
+    CHECK(run(st, 12000, true, 1600, 1800) == CURRENT_FAULT_INRUSH);
+    CHECK(run(st, 2000, true, 1800, 1900) == 0);
+    CHECK(st.faults == 0);
+}
+
+static void test_no_load() {
+    CurrentChannelState st = {};
+    run(st, 0, false, 1000, 1100);
+    // Not before inrush_max_ms, so a load that takes a moment is not flagged
+    CHECK(run(st, 0, true, 1100, 1600) == 0);
+    CHECK(run(st, 0, true, 1600, 1800) == CURRENT_FAULT_NO_LOAD);
+    CHECK(run(st, 2000, true, 1800, 1900) == 0);
+    CHECK(st.faults == 0);
+}
+
+static void test_stuck_on() {
+    CurrentChannelState st = {};
+    CHECK(run(st, 2000, false, 1000, 1100) == CURRENT_FAULT_STUCK_ON);
+    CHECK(run(st, 0, false, 1100, 1200) == 0);
+    CHECK(st.faults == 0);
+}
+
+// The window evaluated right after switch-off still holds on-time samples
+static void test_switch_off_is_not_stuck_on() {
+    CurrentChannelConfig cfg = test_config();
+    CurrentChannelState st = {};
+    run(st, 0, false, 1000, 1100);
+    CHECK(run(st, 2000, true, 1100, 2000) == 0);
+
+    // Relay opens 80 ms into the window that ends at 2000 ms
+    CurrentReading r = reading_of(2000, 0, 1900, 1980);
+    CHECK(r.rms_ma > cfg.no_load_ma);
+    CHECK(current_evaluate(st, cfg, r, false, 2000) == 0);
+    // Even a slow decay over the next window is still inside the settle time
+    CHECK(current_evaluate(st, cfg, reading_of(400, 0), false, 2100) == 0);
+    CHECK(run(st, 0, false, 2200, 3000) == 0);
+    CHECK(st.faults == 0);
+
+    // Current that keeps flowing after the settle time is a stuck contact
+    st = CurrentChannelState();
+    run(st, 0, false, 1000, 1100);
+    run(st, 2000, true, 1100, 2000);
+    CHECK(run(st, 2000, false, 2000, 2200) == 0);
+    CHECK(run(st, 2000, false, 2200, 2300) == CURRENT_FAULT_STUCK_ON);
+}
+
+int main() {
+    test_isqrt();
+    test_readings();
+    test_normal_load();
+    test_overcurrent();
+    test_inrush();
+    test_no_load();
+    test_stuck_on();
+    test_switch_off_is_not_stuck_on();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("current_sense: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""Modbus TCP client test for a running AirBox.
+
+Usage: python3 test/modbus_client_test.py <host> [port]
+
+Talks raw MBAP frames over plain sockets (standard library only) and checks
+function codes 1, 4, 5 and 15, the exception replies, that a Write Multiple
+Coils is never seen half-applied, and several masters at once.
+
+It switches the relays, so run it with nothing connected to them. All relays
+are turned off again at the end.
+"""
+
+import socket
+import struct
+import sys
+import threading
+import time
+import unittest
+
+HOST = "192.168.1.100"
+PORT = 502
+MASTERS_MAX = 4
+
+
+class Master:
+    def __init__(self):
+        self.sock = socket.create_connection((HOST, PORT), timeout=5)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.tid = 0
+
+    def close(self):
+        self.sock.close()
+
+    def recv_exact(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError("connection closed by the box")
+            data += chunk
+        return data
+
+    def request(self, pdu, unit=1):
+        self.tid = (self.tid + 1) & 0xFFFF
+        self.sock.sendall(struct.pack(">HHHB", self.tid, 0, len(pdu) + 1, unit) + pdu)
+        tid, proto, length, resp_unit = struct.unpack(">HHHB", self.recv_exact(7))
+        assert tid == self.tid, "transaction id %d, expected %d" % (tid, self.tid)
+        assert proto == 0 and resp_unit == unit
+        return self.recv_exact(length - 1)
+
+    def read_coils(self, addr=0, count=4):
+        resp = self.request(struct.pack(">BHH", 1, addr, count))
+        assert resp[:2] == bytes([1, 1]), resp
+        return resp[2]
+
+    def read_inputs(self, addr=0, count=4):
+        resp = self.request(struct.pack(">BHH", 4, addr, count))
+        assert resp[:2] == bytes([4, count * 2]), resp
+        return struct.unpack(">%dH" % count, resp[2:])
+
+    def write_coil(self, addr, on):
+        pdu = struct.pack(">BHH", 5, addr, 0xFF00 if on else 0)
+        assert self.request(pdu) == pdu
+
+    def write_coils(self, addr, count, bits):
+        pdu = struct.pack(">BHHB", 15, addr, count, (count + 7) // 8) + bytes([bits])
+        assert self.request(pdu) == pdu[:5]
+
+
+class ModbusTest(unittest.TestCase):
+    def setUp(self):
+        self.master = Master()
+
+    def tearDown(self):
+        self.master.write_coils(0, 4, 0)
+        self.master.close()
+        # Give the box a loop() pass to notice the closed socket
+        time.sleep(0.2)
+
+    def assertException(self, pdu, code):
+        resp = self.master.request(pdu)
+        self.assertEqual(resp, bytes([pdu[0] | 0x80, code]))
+
+    def test_write_single_coil_reads_back(self):
+        self.master.write_coils(0, 4, 0)
+        self.master.write_coil(2, True)
+        self.assertEqual(self.master.read_coils(), 0b0100)
+        self.assertEqual(self.master.read_coils(2, 1), 1)
+        self.master.write_coil(2, False)
+        self.assertEqual(self.master.read_coils(), 0)
+
+    def test_write_multiple_coils_reads_back(self):
+        self.master.write_coils(0, 4, 0b1010)
+        self.assertEqual(self.master.read_coils(), 0b1010)
+        self.master.write_coils(1, 2, 0b01)
+        self.assertEqual(self.master.read_coils(), 0b1010 & ~0b0110 | 0b0010)
+
+    def test_input_registers(self):
+        connected, rssi, up_hi, up_lo = self.master.read_inputs()
+        self.assertIn(connected, (0, 1))
+        rssi = rssi - 0x10000 if rssi & 0x8000 else rssi
+        self.assertTrue(-127 <= rssi <= 0, rssi)
+        uptime = up_hi << 16 | up_lo
+        time.sleep(1.1)
+        up_hi, up_lo = self.master.read_inputs(2, 2)
+        self.assertGreater(up_hi << 16 | up_lo, uptime)
+
+    def test_exceptions(self):
+        self.assertException(struct.pack(">BHH", 3, 0, 1), 0x01)        # unsupported function
+        self.assertException(b"\x07", 0x01)                              # unsupported, no data
+        self.assertException(b"\x11", 0x01)                              # unsupported, no data
+        self.assertException(b"\x01\x00\x00", 0x03)                      # supported, too short
+        self.assertException(struct.pack(">BHH", 1, 3, 2), 0x02)        # coils past IN4
+        self.assertException(struct.pack(">BHH", 1, 0, 0), 0x03)        # zero quantity
+        self.assertException(struct.pack(">BHH", 4, 2, 3), 0x02)        # registers past the end
+        self.assertException(struct.pack(">BHH", 5, 4, 0xFF00), 0x02)   # coil 4 does not exist
+        self.assertException(struct.pack(">BHH", 5, 0, 0x1234), 0x03)   # not ON/OFF
+        self.assertException(struct.pack(">BHHB", 15, 0, 4, 2) + b"\x0f\x00", 0x03)  # byte count
+        self.assertException(struct.pack(">BHHB", 15, 2, 4, 1) + b"\x0f", 0x02)      # past IN4
+
+    def test_rejected_write_changes_nothing(self):
+        self.master.write_coils(0, 4, 0b0110)
+        self.assertException(struct.pack(">BHHB", 15, 1, 4, 1) + b"\x0f", 0x02)
+        self.assertEqual(self.master.read_coils(), 0b0110)
+
+    def test_multiple_coils_never_seen_half_applied(self):
+        # One master flips all four coils back and forth, starting inside the
+        # dwell window of a coil that just switched; another keeps reading.
+        self.master.write_coil(0, True)
+        writer = self.master
+        reader = Master()
+        seen = set()
+        stop = threading.Event()
+
+        def poll():
+            while not stop.is_set():
+                seen.add(reader.read_coils())
+
+        thread = threading.Thread(target=poll)
+        thread.start()
+        try:
+            for i in range(50):
+                writer.write_coils(0, 4, 0b1111 if i % 2 else 0b0000)
+                self.assertIn(writer.read_coils(), (0b0000, 0b1111))
+        finally:
+            stop.set()
+            thread.join()
+            reader.close()
+        self.assertTrue(seen <= {0b0000, 0b0001, 0b1111}, sorted(seen))
+
+    def test_concurrent_masters(self):
+        others = [Master() for _ in range(MASTERS_MAX - 1)]
+        masters = [self.master] + others
+        errors = []
+
+        def run(index, master):
+            try:
+                for _ in range(20):
+                    master.write_coil(index, True)
+                    self.assertTrue(master.read_coils() & (1 << index))
+                    master.write_coil(index, False)
+                    master.read_inputs()
+            except Exception as e:  # reported below, from the main thread
+                errors.append((index, e))
+
+        threads = [threading.Thread(target=run, args=(i, m)) for i, m in enumerate(masters)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        try:
+            self.assertEqual(errors, [])
+
+            # Every slot is taken now, so one more master is turned away
+            extra = Master()
+            try:
+                with self.assertRaises(ConnectionError):
+                    extra.read_coils()
+            finally:
+                extra.close()
+        finally:
+            for m in others:
+                m.close()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    HOST = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    unittest.main(argv=sys.argv[:1], verbosity=2)